@@ -0,0 +1,402 @@
+/*
+Microbenchmark of the calculator engine in calculator.h, one JSON report on stdout
+
+    g++ -std=c++17 -O2 -pthread -o benchmark benchmark.cpp
+    ./benchmark > before.json    (then rebuild with the change and compare with after.json)
+
+Every category of the built-in corpus is timed stage by stage: lexing alone
+(Token_stream::get_Token() until the end of the statement), compiling (lexing, the
+recursive descent and the optimizer, reported as parse without the lexing time) and
+evaluating the compiled Program. Each stage runs several times and the fastest run
+counts, so the numbers are stable enough to compare builds. Allocations are counted
+by replacing the global operator new.
+
+Options: --repeat n (runs per stage, 5), --size n (statements per category, 2000),
+--no-optimize, --corpus file (time the lines of a file as one more category).
+
+--trig reports the degree functions instead: the error in ulps of sind, cosd, tand and
+cotd against a long double reference, next to the naive sin(x * pi / 180) of libm, and
+the time per call of the scalar kernel, the block kernel and libm.
+*/
+
+#include "calculator.h"
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <random>
+
+//------------------------------------------------------------------------------
+
+// This section counts allocations
+
+static atomic<long> allocations {0};  // reduction helpers allocate on threads of their own
+
+/* Neither is inlined, or GCC pairs the malloc() or free() with its own operator new or delete and warns */
+__attribute__((noinline)) void *operator new(size_t n) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void *p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+//------------------------------------------------------------------------------
+
+// This section generates the corpus
+
+/* Statements of one kind, made from a fixed seed so every build times the same text */
+struct Category
+{
+    string name;
+    vector<string> statements;
+};
+
+class Corpus_generator
+{
+    private:
+        mt19937 gen {2019};  // not the calculator's rng, so rand() statements do not change the corpus
+        int pick(int lo, int hi) { return uniform_int_distribution<int>(lo, hi)(gen); }
+        string number();
+        string op() { return string(1, "+-*/"[pick(0, 3)]); }
+    public:
+        string arithmetic();
+        string parentheses();
+        string variables();
+        string builtins();
+        string random();
+        string factorials();
+};
+
+string Corpus_generator::number() {
+    if (pick(0, 3) == 0) return to_string(pick(1, 999)) + "." + to_string(pick(0, 99));
+    return to_string(pick(1, 99));
+}
+
+/* 3 + 4.5 * 2 - 7 / 5 */
+string Corpus_generator::arithmetic() {
+    string s = number();
+    for (int i = pick(2, 6); i > 0; i--) s += " " + op() + " " + number();
+    return s;
+}
+
+/* ((((1 + 2) * 3) - 4) / 5), 8 to 24 levels */
+string Corpus_generator::parentheses() {
+    int depth = pick(8, 24);
+    string s(depth, '(');
+    s += number();
+    for (int i = 0; i < depth; i++) s += " " + op() + " " + number() + ")";
+    return s;
+}
+
+/* a * b + c / d - ..., over the variables a to z, where e is the constant */
+string Corpus_generator::variables() {
+    string s(1, char('a' + pick(0, 25)));
+    for (int i = pick(4, 10); i > 0; i--) s += " " + op() + " " + char('a' + pick(0, 25));
+    return s;
+}
+
+/* sin(x) + log2(y) * cosd(30) + sqrt(z) */
+string Corpus_generator::builtins() {
+    static const char *functions[] = {"sin", "cos", "tan", "sind", "cosd", "log", "log2", "log10", "sqrt", "gamma"};
+    string s;
+    for (int i = pick(2, 5); i > 0; i--) {
+        if (!s.empty()) s += " " + op() + " ";
+        string arg = pick(0, 1) ? string(1, char('a' + pick(0, 25))) : number();
+        s += string(functions[pick(0, 9)]) + "(" + arg + ")";
+    }
+    return s;
+}
+
+/* rand(10) + rand(1, 4) */
+string Corpus_generator::random() {
+    string s;
+    for (int i = pick(1, 4); i > 0; i--) {
+        if (!s.empty()) s += " + ";
+        s += pick(0, 1) ? "rand(" + number() + ")" : "rand(" + to_string(pick(0, 9)) + ", " + to_string(pick(10, 99)) + ")";
+    }
+    return s;
+}
+
+/* 5! + 10! / 3! + 0.5! */
+string Corpus_generator::factorials() {
+    string s;
+    for (int i = pick(1, 4); i > 0; i--) {
+        if (!s.empty()) s += " " + op() + " ";
+        s += (pick(0, 4) ? to_string(pick(0, 170)) : "0." + to_string(pick(1, 9))) + "!";
+    }
+    return s;
+}
+
+vector<Category> make_corpus(int size) {
+    Corpus_generator g;
+    vector<Category> corpus {{"arithmetic", {}}, {"parentheses", {}}, {"variables", {}}, {"builtins", {}}, {"rand", {}}, {"factorial", {}}};
+    for (int i = 0; i < size; i++) {
+        corpus[0].statements.push_back(g.arithmetic());
+        corpus[1].statements.push_back(g.parentheses());
+        corpus[2].statements.push_back(g.variables());
+        corpus[3].statements.push_back(g.builtins());
+        corpus[4].statements.push_back(g.random());
+        corpus[5].statements.push_back(g.factorials());
+    }
+    return corpus;
+}
+
+//------------------------------------------------------------------------------
+
+// This section times the stages
+
+struct Result
+{
+    long statements {0};
+    long tokens {0};
+    double lex {0};      // seconds for the whole category, fastest run
+    double compile {0};
+    double eval {0};
+    long allocations {0};
+    long errors {0};
+};
+
+/* Fastest of repeat runs of f, in seconds */
+template<class F>
+double fastest(int repeat, F f) {
+    double best = 1e300;
+    for (int i = 0; i < repeat; i++) {
+        auto t0 = chrono::steady_clock::now();
+        f();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+    }
+    return best;
+}
+
+volatile double sink;  // keeps results alive so evaluation is not optimized away
+
+Result measure(const vector<string> &statements, Session &session, int repeat) {
+    Result r;
+    r.statements = long(statements.size());
+    vector<Program> programs;
+    for (const string &s : statements) {
+        Expected<Program> p = try_compile(s, static_cast<const Session&>(session));
+        if (p) programs.push_back(move(*p));
+        else r.errors++;
+    }
+
+    r.lex = fastest(repeat, [&] {
+        long tokens = 0;
+        for (const string &s : statements) {
+            Token_stream ts(s, session.symbols, nullptr);
+            for (char key = ts.get_Token().key; key != print && key != bad; key = ts.get_Token().key) tokens++;
+        }
+        r.tokens = tokens;
+    });
+    r.compile = fastest(repeat, [&] {
+        for (const string &s : statements) {
+            Expected<Program> p = try_compile(s, static_cast<const Session&>(session));
+            sink = p ? p->depth : 0;
+        }
+    });
+    r.eval = fastest(repeat, [&] {
+        double sum = 0;
+        for (const Program &p : programs) {
+            try {
+                sum += p.is_array ? evaluate_array(p, session)[0] : evaluate(p, session);
+            }
+            catch (exception &) {}
+        }
+        sink = sum;
+    });
+
+    long before = allocations;
+    for (const string &s : statements) {
+        Expected<Program> p = try_compile(s, static_cast<const Session&>(session));
+        try {
+            if (p) sink = p->is_array ? evaluate_array(*p, session)[0] : evaluate(*p, session);
+        }
+        catch (exception &) {}
+    }
+    r.allocations = allocations - before;
+    return r;
+}
+
+/* s as a JSON string, a --corpus path may hold quotes or backslashes */
+string json_string(const string &s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            snprintf(code, sizeof code, "\\u%04x", c);
+            out += code;
+        }
+        else out += c;
+    }
+    return out + '"';
+}
+
+void print_result(const string &name, const Result &r, bool last) {
+    double n = max(r.statements, 1L);
+    printf("    {\"name\": %s, \"statements\": %ld, \"tokens\": %ld, \"errors\": %ld, ", json_string(name).c_str(), r.statements, r.tokens, r.errors);
+    printf("\"tokens_per_sec\": %.0f, \"statements_per_sec\": %.0f, ", r.tokens / max(r.lex, 1e-12), r.statements / max(r.compile + r.eval, 1e-12));
+    printf("\"ns_lex\": %.1f, \"ns_parse\": %.1f, \"ns_eval\": %.1f, ", r.lex / n * 1e9, max(r.compile - r.lex, 0.0) / n * 1e9, r.eval / n * 1e9);
+    printf("\"allocs_per_statement\": %.2f}%s\n", r.allocations / n, last ? "" : ",");
+}
+
+//------------------------------------------------------------------------------
+
+// This section measures the degree functions of simd.h against libm
+
+/* sind (0), cosd (1), tand (2) or cotd (3) of x in long double, reduced exactly by 90 first */
+long double reference_deg(double x, int which) {
+    long double r = fmodl(x, 360);
+    long double q = nearbyintl(r / 90), y = r - 90 * q;
+    long double a = y * 3.141592653589793238462643383279502884L / 180;
+    long double s = sinl(a), c = cosl(a);
+    switch (int(q) & 3) {
+        case 1: swap(s, c); c = -c; break;
+        case 2: s = -s; c = -c; break;
+        case 3: swap(s, c); s = -s; break;
+    }
+    if (which < 2) return which == 0 ? s : c;
+    return which == 2 ? s / c : c / s;
+}
+
+/* Error of v in units of the last place of the reference r, which is finite and not 0 */
+double ulps(double v, long double r) {
+    int e;
+    frexpl(r, &e);
+    return double(fabsl(v - r) / ldexpl(1, max(e, -1021) - 53));
+}
+
+double naive_deg(double x, int which) {
+    double a = x * (M_PI / 180);
+    switch (which) {
+        case 0: return sin(a);
+        case 1: return cos(a);
+        case 2: return tan(a);
+        default: return 1 / tan(a);
+    }
+}
+
+int trig_report(int repeat, int size) {
+    static const char *names[] = {"sind", "cosd", "tand", "cotd"};
+    mt19937 gen {2019};
+    vector<double> x(size), out(size);
+    for (int i = 0; i < size; i++) {  // mostly small angles, some huge, some whole degrees
+        switch (i % 4) {
+            case 0: x[i] = uniform_real_distribution<double>(-360, 360)(gen); break;
+            case 1: x[i] = uniform_real_distribution<double>(-1e6, 1e6)(gen); break;
+            case 2: x[i] = ldexp(uniform_real_distribution<double>(-1, 1)(gen), uniform_int_distribution<int>(0, 60)(gen)); break;
+            default: x[i] = uniform_int_distribution<int>(-1000, 1000)(gen) + 0.5 * (i % 8 == 3); break;
+        }
+    }
+
+    printf("{\n  \"build\": {\"compiler\": \"%s\", \"pack_width\": %d, \"repeat\": %d, \"size\": %d},\n", __VERSION__, pack_width, repeat, size);
+    printf("  \"functions\": [\n");
+    for (int which = 0; which < 4; which++) {
+        double worst = 0, mean = 0, naive_worst = 0, naive_mean = 0;
+        long counted = 0, zeros = 0, missed = 0, naive_missed = 0;  // exact zeros and infinities are counted apart
+        for (double v : x) {
+            bool finite = true;
+            double k = trig_deg(v, which, finite), naive = naive_deg(v, which);
+            long double r = reference_deg(v, which);
+            if (isinf(r) || r == 0) {
+                zeros++;
+                missed += isinf(r) ? !isinf(k) : k != 0;  // the sign of an infinity is moot, tand(90) is an error
+                naive_missed += isinf(r) ? !isinf(naive) : naive != 0;
+                continue;
+            }
+            double e = ulps(k, r), ne = ulps(naive, r);
+            worst = max(worst, e);
+            naive_worst = max(naive_worst, ne);
+            mean += e;
+            naive_mean += ne;
+            counted++;
+        }
+        double scalar = fastest(repeat, [&] {
+            double sum = 0;
+            bool finite = true;
+            for (double v : x) sum += trig_deg(v, which, finite);
+            sink = sum;
+        });
+        double block = fastest(repeat, [&] {
+            for (int i = 0; i < size; i += block_size) vec_trig_deg(x.data() + i, out.data() + i, min(block_size, size - i), which);
+            sink = out[size / 2];
+        });
+        double libm = fastest(repeat, [&] {
+            double sum = 0;
+            for (double v : x) sum += naive_deg(v, which);
+            sink = sum;
+        });
+        printf("    {\"name\": \"%s\", \"max_ulp\": %.3f, \"mean_ulp\": %.4f, \"libm_max_ulp\": %.3g, \"libm_mean_ulp\": %.3g, ", names[which], worst, mean / max(counted, 1L), naive_worst, naive_mean / max(counted, 1L));
+        printf("\"exact_values\": %ld, \"missed\": %ld, \"libm_missed\": %ld, ", zeros, missed, naive_missed);
+        printf("\"ns_scalar\": %.2f, \"ns_block\": %.2f, \"ns_libm\": %.2f}%s\n", scalar / size * 1e9, block / size * 1e9, libm / size * 1e9, which == 3 ? "" : ",");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) try
+{
+    int repeat = 5, size = 2000;
+    bool trig = false;
+    string corpus_file;
+    Session session;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc) repeat = max(1, atoi(argv[++i]));
+        else if (arg == "--size" && i + 1 < argc) size = max(1, atoi(argv[++i]));
+        else if (arg == "--corpus" && i + 1 < argc) corpus_file = argv[++i];
+        else if (arg == "--no-optimize") session.optimize = false;
+        else if (arg == "--trig") trig = true;
+        else {
+            cerr << "Usage: " << argv[0] << " [--repeat n] [--size n] [--no-optimize] [--corpus file] [--trig]\n";
+            return 1;
+        }
+    }
+    if (trig) return trig_report(repeat, size * 500);
+
+    for (char c = 'a'; c <= 'z'; c++) {
+        if (c != 'e') session.symbols.set(session.symbols.intern(string(1, c)), 1 + (c - 'a') * 0.25);  // e stays the constant
+    }
+    rng.seed(2019);
+    vector<Category> corpus = make_corpus(size);
+    if (!corpus_file.empty()) {
+        ifstream in(corpus_file);
+        if (!in) error("cannot open \"" + corpus_file + "\"");
+        Category c {corpus_file, {}};
+        string line;
+        while (getline(in, line)) {
+            if (line.find_first_not_of(" \t\r") != string::npos) c.statements.push_back(line);
+        }
+        corpus.push_back(c);
+    }
+
+    Result total;
+    printf("{\n  \"build\": {\"compiler\": \"%s\", \"pack_width\": %d, \"optimize\": %s, \"repeat\": %d},\n", __VERSION__, pack_width, session.optimize ? "true" : "false", repeat);
+    printf("  \"categories\": [\n");
+    for (size_t i = 0; i < corpus.size(); i++) {
+        Result r = measure(corpus[i].statements, session, repeat);
+        print_result(corpus[i].name, r, i + 1 == corpus.size());
+        total.statements += r.statements;
+        total.tokens += r.tokens;
+        total.lex += r.lex;
+        total.compile += r.compile;
+        total.eval += r.eval;
+        total.allocations += r.allocations;
+        total.errors += r.errors;
+    }
+    printf("  ],\n  \"total\":\n");
+    print_result("total", total, true);
+    printf("}\n");
+    return 0;
+}
+catch (exception &e)
+{
+    cerr << "Error: " << e.what() << '\n';
+    return 1;
+}
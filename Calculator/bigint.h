@@ -0,0 +1,288 @@
+/*
+Arbitrary-precision integers for the exact mode of the calculator
+
+Magnitudes are kept in base 10^9, least significant limb first, so printing all the
+digits is cheap. Long products use Karatsuba multiplication, and factorials are
+multiplied by binary splitting so both sides of every product have similar sizes,
+which is where Karatsuba pays off: 10000! takes a few milliseconds.
+*/
+
+#ifndef BIGINT_H
+#define BIGINT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class Big_int
+{
+    public:
+        Big_int() {}
+        Big_int(long long n);
+        static Big_int from_double(double x);  // x must be an integer
+        static Big_int factorial(unsigned long n);
+
+        bool negative() const { return neg; }
+        bool is_zero() const { return mag.empty(); }
+        bool to_long(long long &n) const;  // false if it does not fit
+        double to_double() const;
+        std::string to_string() const;
+
+        Big_int operator-() const;
+        Big_int pow(unsigned long k) const;
+        friend Big_int operator+(const Big_int &a, const Big_int &b);
+        friend Big_int operator-(const Big_int &a, const Big_int &b);
+        friend Big_int operator*(const Big_int &a, const Big_int &b);
+
+    private:
+        typedef std::vector<uint32_t> Limbs;
+        static const uint32_t base = 1000000000;
+        static const size_t karatsuba_cutoff = 40;  // limbs, below this schoolbook is faster
+
+        Limbs mag;  // magnitude, no leading zero limbs, empty for 0
+        bool neg {false};
+
+        static void trim(Limbs &a);
+        static int compare(const Limbs &a, const Limbs &b);
+        static void add_to(Limbs &r, const uint32_t *a, size_t n, size_t shift);
+        static void sub_from(Limbs &r, const Limbs &a);  // r >= a
+        static void mul_small(Limbs &a, uint32_t m);
+        static Limbs schoolbook(const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+        static Limbs multiply(const uint32_t *a, size_t na, const uint32_t *b, size_t nb);
+        static Limbs product(unsigned long lo, unsigned long hi);
+        static Big_int add(const Big_int &a, const Big_int &b, bool negate_b);
+};
+
+inline Big_int::Big_int(long long n) {
+    neg = n < 0;
+    unsigned long long m = neg ? 0 - (unsigned long long)n : (unsigned long long)n;
+    while (m) {
+        mag.push_back(uint32_t(m % base));
+        m /= base;
+    }
+}
+
+/* Exact value of an integral double, which may be far beyond 64 bits */
+inline Big_int Big_int::from_double(double x) {
+    if (std::fabs(x) < 9e18) return Big_int((long long)x);
+    int e;
+    double m = std::frexp(std::fabs(x), &e);  // x = m * 2^e, 0.5 <= m < 1
+    Big_int r((long long)std::ldexp(m, 53));
+    for (e -= 53; e > 0; e -= std::min(e, 29)) mul_small(r.mag, 1u << std::min(e, 29));
+    r.neg = x < 0;
+    return r;
+}
+
+inline void Big_int::trim(Limbs &a) {
+    while (!a.empty() && a.back() == 0) a.pop_back();
+}
+
+inline int Big_int::compare(const Limbs &a, const Limbs &b) {
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0;) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/* r += a * base^shift */
+inline void Big_int::add_to(Limbs &r, const uint32_t *a, size_t n, size_t shift) {
+    if (r.size() < shift + n + 1) r.resize(shift + n + 1, 0);
+    uint32_t carry = 0;
+    size_t i = 0;
+    for (; i < n || carry; i++) {
+        if (shift + i == r.size()) r.push_back(0);
+        uint32_t sum = r[shift + i] + carry + (i < n ? a[i] : 0);
+        carry = sum >= base;
+        r[shift + i] = carry ? sum - base : sum;
+    }
+}
+
+inline void Big_int::sub_from(Limbs &r, const Limbs &a) {
+    int64_t borrow = 0;
+    for (size_t i = 0; i < r.size() && (i < a.size() || borrow); i++) {
+        int64_t d = int64_t(r[i]) - borrow - (i < a.size() ? a[i] : 0);
+        borrow = d < 0;
+        r[i] = uint32_t(borrow ? d + base : d);
+    }
+    trim(r);
+}
+
+inline void Big_int::mul_small(Limbs &a, uint32_t m) {
+    uint64_t carry = 0;
+    for (uint32_t &limb : a) {
+        uint64_t cur = uint64_t(limb) * m + carry;
+        limb = uint32_t(cur % base);
+        carry = cur / base;
+    }
+    while (carry) {
+        a.push_back(uint32_t(carry % base));
+        carry /= base;
+    }
+}
+
+inline Big_int::Limbs Big_int::schoolbook(const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    Limbs r(na + nb, 0);
+    for (size_t i = 0; i < na; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < nb; j++) {
+            uint64_t cur = r[i + j] + uint64_t(a[i]) * b[j] + carry;  // < 10^18 + 2 * 10^9
+            r[i + j] = uint32_t(cur % base);
+            carry = cur / base;
+        }
+        for (size_t k = i + nb; carry; k++) {
+            uint64_t cur = r[k] + carry;
+            r[k] = uint32_t(cur % base);
+            carry = cur / base;
+        }
+    }
+    trim(r);
+    return r;
+}
+
+/* Karatsuba: with a = a1 * B + a0 and b = b1 * B + b0,
+   a * b = z2 * B^2 + ((a0 + a1) * (b0 + b1) - z2 - z0) * B + z0 */
+inline Big_int::Limbs Big_int::multiply(const uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    while (na > 0 && a[na - 1] == 0) na--;
+    while (nb > 0 && b[nb - 1] == 0) nb--;
+    if (na < nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    if (nb == 0) return Limbs();
+    if (nb < karatsuba_cutoff) return schoolbook(a, na, b, nb);
+
+    size_t m = (na + 1) / 2;
+    Limbs r;
+    if (nb <= m) {  // b is short, only a is split
+        r = multiply(a, m, b, nb);
+        Limbs hi = multiply(a + m, na - m, b, nb);
+        add_to(r, hi.data(), hi.size(), m);
+        trim(r);
+        return r;
+    }
+
+    Limbs z0 = multiply(a, m, b, m);
+    Limbs z2 = multiply(a + m, na - m, b + m, nb - m);
+    Limbs sa(a, a + m), sb(b, b + m);
+    add_to(sa, a + m, na - m, 0);
+    add_to(sb, b + m, nb - m, 0);
+    Limbs z1 = multiply(sa.data(), sa.size(), sb.data(), sb.size());
+    sub_from(z1, z0);
+    sub_from(z1, z2);
+
+    r = z0;
+    add_to(r, z1.data(), z1.size(), m);
+    add_to(r, z2.data(), z2.size(), 2 * m);
+    trim(r);
+    return r;
+}
+
+/* lo * (lo + 1) * ... * hi, halves of equal length so the multiplications are balanced */
+inline Big_int::Limbs Big_int::product(unsigned long lo, unsigned long hi) {
+    if (hi - lo < 16) {
+        Limbs r(1, 1);
+        for (unsigned long i = lo; i <= hi; i++) mul_small(r, uint32_t(i));
+        return r;
+    }
+    unsigned long mid = lo + (hi - lo) / 2;
+    Limbs a = product(lo, mid), b = product(mid + 1, hi);
+    return multiply(a.data(), a.size(), b.data(), b.size());
+}
+
+inline Big_int Big_int::factorial(unsigned long n) {
+    Big_int r(1);
+    if (n > 1) r.mag = product(2, n);
+    return r;
+}
+
+inline bool Big_int::to_long(long long &n) const {
+    if (mag.size() > 3) return false;
+    unsigned long long m = 0;
+    for (size_t i = mag.size(); i-- > 0;) {
+        if (m > (~0ull - mag[i]) / base) return false;
+        m = m * base + mag[i];
+    }
+    if (m > 9223372036854775807ull) return false;
+    n = neg ? -(long long)m : (long long)m;
+    return true;
+}
+
+/* Nearest double, inf when it is too large */
+inline double Big_int::to_double() const {
+    double r = 0;
+    size_t top = std::min<size_t>(mag.size(), 3);  // 27 digits are plenty for 53 bits
+    for (size_t i = 0; i < top; i++) r = r * base + mag[mag.size() - 1 - i];
+    r *= std::pow(10.0, 9.0 * double(mag.size() - top));
+    return neg ? -r : r;
+}
+
+inline std::string Big_int::to_string() const {
+    if (mag.empty()) return "0";
+    std::string s = neg ? "-" : "";
+    s += std::to_string(mag.back());
+    char limb[16];
+    for (size_t i = mag.size() - 1; i-- > 0;) {
+        std::snprintf(limb, sizeof(limb), "%09u", mag[i]);
+        s += limb;
+    }
+    return s;
+}
+
+inline Big_int Big_int::operator-() const {
+    Big_int r = *this;
+    if (!r.mag.empty()) r.neg = !r.neg;
+    return r;
+}
+
+inline Big_int Big_int::add(const Big_int &a, const Big_int &b, bool negate_b) {
+    bool bneg = negate_b ? !b.neg : b.neg;
+    Big_int r;
+    if (a.neg == bneg) {
+        r.mag = a.mag;
+        add_to(r.mag, b.mag.data(), b.mag.size(), 0);
+        trim(r.mag);
+        r.neg = a.neg;
+    }
+    else if (compare(a.mag, b.mag) >= 0) {
+        r.mag = a.mag;
+        sub_from(r.mag, b.mag);
+        r.neg = a.neg;
+    }
+    else {
+        r.mag = b.mag;
+        sub_from(r.mag, a.mag);
+        r.neg = bneg;
+    }
+    if (r.mag.empty()) r.neg = false;
+    return r;
+}
+
+inline Big_int operator+(const Big_int &a, const Big_int &b) {
+    return Big_int::add(a, b, false);
+}
+
+inline Big_int operator-(const Big_int &a, const Big_int &b) {
+    return Big_int::add(a, b, true);
+}
+
+inline Big_int operator*(const Big_int &a, const Big_int &b) {
+    Big_int r;
+    r.mag = Big_int::multiply(a.mag.data(), a.mag.size(), b.mag.data(), b.mag.size());
+    r.neg = !r.mag.empty() && a.neg != b.neg;
+    return r;
+}
+
+inline Big_int Big_int::pow(unsigned long k) const {
+    Big_int r(1), b = *this;
+    for (; k; k >>= 1) {
+        if (k & 1) r = r * b;
+        if (k > 1) b = b * b;
+    }
+    return r;
+}
+
+#endif
@@ -4,556 +4,559 @@ This is the modification of the example code from Chapter 6.7 "Principles and Pr
 n33 (2019.5.19)
 */
 
-#define _USE_MATH_DEFINES  // to use M_PI, M_E
-#include <iostream>
-#include <string>
-#include <vector>
-#include <algorithm>
-#include <cmath>
-#include <unordered_map>
-#include <unordered_set>
-#include <random>
-#include <chrono>  // to set random number seed 
-using namespace std;
+#include "calculator.h"
+#include "thread_pool.h"
+#include <cstdio>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include "server.h"
+#endif
 
 //------------------------------------------------------------------------------
 
-// This section contains some operational-use functions
+/* Print an array result, leaving out the middle of long arrays */
+void print_array(const vector<double> &a) {
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a.size() > 10 && i == 5) {
+            cout << "...  ";
+            i = a.size() - 5;
+        }
+        cout << a[i] << "  ";
+    }
+    cout << "(" << a.size() << " elements)\n";
+}
 
-/* Display error */
-void error(string message)
-{
-    throw runtime_error(message);
+/* All digits of an integer result in the exact mode, false when p is not exact */
+inline bool exact_result(const Program &p, const Session &session, string &digits) {
+    if (!session.exact || p.target >= 0 || !is_integer_program(p, session)) return false;
+    digits = evaluate_exact(p, session).to_string();
+    return true;
 }
 
-/* Create separation line in terminal window */
-string display_line(int n) {
-    string s;
-    for (int i = 0; i < n ; i++) {
-        s += "-";  // the separation line consists of multiple '-' symbols
-    }
-    s += '\n';
-    return s;
+/* Counts and timings of the hot paths so far, see stats.h */
+void show_stats(ostream &os) {
+#if CALCULATOR_STATS
+    vector<string_view> names;
+    for (const Builtin &b : builtins) names.push_back(b.name);
+    print_stats(os, names);
+#else
+    os << "Statistics are compiled out, build without -DCALCULATOR_STATS=0\n";
+#endif
 }
 
-//------------------------------------------------------------------------------
+void show_stats_at_exit() { show_stats(cerr); }
 
-// This section contains some preliminary declarations
-unordered_map<string, double> dict;  // stores variables
-unordered_set<string> ban;  // stores prohibited names for variables
+/* Carry out a line starting with '#' */
+void command(const string &line, Session &session) {
+    istringstream is(line.substr(line.find(special) + 1));
+    string name;
+    is >> name;
+    if (name == "exact") {  // #exact switches the exact mode on and off
+        session.exact = !session.exact;
+        cout << "Exact integer results are " << (session.exact ? "on" : "off") << '\n';
+    }
+    else if (name == "stats") {  // #stats shows the counts, #stats reset starts them over
+        string arg;
+        is >> arg;
+        if (arg == "reset") {
+            reset_stats();
+            cout << "Statistics are reset\n";
+        }
+        else show_stats(cout);
+    }
+    else if (name == "optimize") {  // #optimize x^3 + x^3 shows what the optimizer does with a statement
+        string rest;
+        getline(is, rest);
+        if (rest.find_first_not_of(" \t\r") == string::npos) {
+            session.optimize = !session.optimize;
+            cout << "Optimizer is " << (session.optimize ? "on" : "off") << '\n';
+            return;
+        }
+        Program p = compile(rest, static_cast<const Session&>(session));
+        cout << p.code.size() << " instructions, " << p.removed << " nodes removed\n";
+    }
+    else error("Unknown command \"#" + name + "\"");
+}
 
-const char print = '\n';  // press Enter to calculate
-const char quit = '$';  // use $ because it cannot be a name
-const char number = 'n';
-const char caled = 'c';  // means calculated, to prevent last result keep being displayed 
-const char define = '@';  
-const char special = '#';  // special operation
-const char comma = 'a';  // saw a comma, so there are both lower bound and upper bound
+/* Read inputs, calculates then print */
+void calculate(Session &session) {
+    Symbol_table &symbols = session.symbols;
+    const int ans = symbols.intern("ans");
+    string line;
+    while (getline(cin, line)) {
+        try {
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == string::npos) continue;  // if user keeps pressing Enter for fun or habit
+            if (line[first] == quit) break;
+            if (line[first] == special) {
+                command(line, session);
+                cout << display_line(100);
+                continue;
+            }
 
-//------------------------------------------------------------------------------
+            Program p = compile(line, session);
+            if (p.is_array) {
+                vector<double> result = run_array(p, session);
+                if (p.target >= 0) cout << "Variable \"" << symbols.names[p.target] << "\" is defined, " << symbols.arrays[p.target].size() << " elements\n";
+                else print_array(result);
+                cout << display_line(100);
+                continue;
+            }
+            string digits;
+            if (exact_result(p, session, digits)) {
+                session.assign(ans, evaluate(p, session));
+                cout << digits << '\n';
+                cout << display_line(100);
+                continue;
+            }
+            double result = run(p, session);
+            if (p.target >= 0) {
+                cout << "Variable \"" << symbols.names[p.target] << "\" is defined\n";
+                cout << display_line(100);
+            }
+            else {  // print calculation result
+                session.assign(ans, result);  // so that ans can be used like MATLAB
+                cout << result << '\n';
+                cout << display_line(100);
+            }
+        }
+        catch (exception &e) {
+            cerr << "Error: " << e.what() << '\n';
+            cout << "\nErrors have been cleared, you can run the calculator as usual or press '$' to exit.\n";
+            cout << display_line(100);
+        }
+    }
+}
 
-// This section contains the calculator Token class 
+//------------------------------------------------------------------------------
 
-/* Token is a user-defined type for whatever the user inputs for calculation */
-class Token 
-{
-    public:
-        char key;  
-        double value; 
-        string name;
-        Token(): key('d'), value(1) {}  // default Token constructor, 1 because *1, /1 = 1
-        Token(char ch): key(ch), value(0) {}  // make a Token from a symbol   
-        Token(char ch, double val): key(ch), value(val) {}  // make a Token from a number
-        Token(char ch, string s): key(ch), name(s) {}  // make a Token from a variable
-};
+// This section contains the non-interactive batch mode
 
-/* Stores Tokens in a way similar to iostream */
-class Token_stream 
+/* Collects output and writes it in large blocks, no per-result flushing */
+class Out_buffer
 {
     private:
-        bool full {false}; // is there a Token in the buffer?
-        Token buffer;      // here is where we keep a Token put back using putback()
-    public: 
-        Token_stream(): full(false), buffer(0) {};   // make a Token_stream that reads from cin
-        Token get_Token();      // get a Token 
-        void putback(Token t);    // put a Token back
-        void reset();  // reset if error occurs
+        FILE *file;
+        vector<char> buf;
+        size_t used {0};
+    public:
+        Out_buffer(FILE *f, size_t size = 1 << 20): file(f), buf(size) {}
+        ~Out_buffer() { flush(); }
+        void write(const char *s, size_t n);
+        void write_number(double val);
+        void flush();
 };
 
-/* Read the next input and convert it to a Token */
-Token Token_stream::get_Token()
-{
-    if (full) {  // if already has a Token in stream buffer
-        full = false;
-        return buffer;
-    } 
-
-    char ch; cin.get(ch);  // to read '\n'
-    while (true) {
-        switch (ch) {
-            case ' ': case '\t': {  // ignore whitespaces
-                cin.get(ch); break;
-            }
-            case print: case quit:
-            case '(': case ')': case '+': case '-': case '*': case '/': case '%': case '^': case '!': case ',': {
-                return Token(ch);
-            } 
-            case '.':
-            case '0': case '1': case '2': case '3': case '4':
-            case '5': case '6': case '7': case '8': case '9': {
-                cin.putback(ch);
-                double val; cin >> val;  // read the whole number
-                return Token(number, val);
-            }
-            default:
-                if (isalpha(ch)) {
-                    string v_name; v_name += ch;
-                    while (cin.get(ch) && (isalpha(ch) || isdigit(ch) || ch == '_')) v_name += ch;  // variable name ends at eof or '='
-                    while (ch == ' ' || ch == '\t') cin.get(ch);
-                    if (ch == '=') {  // if define a variable
-                        if (ban.find(v_name) != ban.end()) {
-                            error("\"" + v_name + "\" is a built-in name.");
-                        }
-                        else {  // if variable name is OK to use
-                            cin >> ch; cin.putback(ch);  // outside below if(s) because the first if will read ch then the second if won't read the same element
-                            if (isdigit(ch) || isalpha(ch)) {  // define variable using numbers or other variables
-                                return Token(define, v_name);
-                            }
-                            else {
-                                error("Wrong way to define variables!");
-                            }
-                        }
-                    }
-                    else {  // if use a variable
-                        cin.putback(ch);
-                        if (ban.find(v_name) != ban.end()) {  // if a special operation
-                            return Token(special, v_name);
-                        }
-                        else if (v_name.substr(0, 3) == "log") {  // if a logarithm
-                            return Token(special, v_name);
-                        }                        
-                        else {
-                            if (dict.find(v_name) != dict.end()) return Token(number, dict[v_name]);
-                            else error("No such variable \"" + v_name + "\"");
-                        }
-                    }
-                }
-                error("Bad token");
-                return 1; // because this is not a void function
-        }
+inline void Out_buffer::write(const char *s, size_t n) {
+    if (used + n > buf.size()) flush();
+    if (n > buf.size()) {  // too long to buffer
+        fwrite(s, 1, n, file);
+        return;
     }
+    memcpy(buf.data() + used, s, n);
+    used += n;
 }
 
-/* Put Token back into the Token_stream's buffer */
-void Token_stream::putback(Token t) {
-    if (full) error("Token stream already full, cannot put back");
-    buffer = t;       // copy t to buffer
-    full = true;      // buffer is now full
+/* Same format as cout with precision 7, one number per line, returns the length */
+inline int format_number(char *s, double val) {
+    return snprintf(s, 32, "%.7g\n", val);
 }
 
-/* Ignore what's left in Token stream */
-void Token_stream::reset() {
-    full = false;
-    if (buffer.key != print) {
-        char ch;
-        while (cin.get(ch)) {
-            if (ch == print) break;
-        }
-    }
-    cin.clear();  // seems without this above while loop won't be executed
-    cout << "\nErrors have been cleared, you can run the calculator as usual or press '$' to exit.\n";
-    cout << display_line(100);
+inline void Out_buffer::write_number(double val) {
+    if (used + 32 > buf.size()) flush();
+    used += format_number(buf.data() + used, val);
 }
 
-//------------------------------------------------------------------------------
-
-// This section defines some special operations
-
-Token statement();  // below special operations nee to know what is statement
-
-/* Initialize constant names and values */
-void init_const() {
-    ban.insert("pi");
-    ban.insert("e");
-    ban.insert("inf");
-    ban.insert("sqrt");
-    ban.insert("log");
-    ban.insert("sin");
-    ban.insert("cos");
-    ban.insert("tan");
-    ban.insert("cot");
-    ban.insert("sind");
-    ban.insert("cosd");
-    ban.insert("tand");
-    ban.insert("cotd");
-    ban.insert("rand");
-
-    dict["pi"] = M_PI; 
-    dict["e"] = M_E;
+inline void Out_buffer::flush() {
+    if (used > 0) fwrite(buf.data(), 1, used, file);
+    used = 0;
 }
 
-/* Factorial */
-double factorial(int n) {
-    int sum {1};
-    if (n != 0) {
-        for (int i = n; i > 0; i--) {
-            sum *= i;
+/* A whole input file, mapped into memory where possible and read otherwise */
+class Input_file
+{
+    private:
+        const char *map {nullptr};
+        size_t length {0};
+        vector<char> copy;  // when the file cannot be mapped
+    public:
+        ~Input_file();
+        bool open(const string &path, bool read_all);
+        const char *data() const { return map ? map : copy.data(); }
+        size_t size() const { return map ? length : copy.size(); }
+        bool mapped() const { return map != nullptr; }
+};
+
+/* Maps the file, or with read_all reads files that cannot be mapped such as pipes */
+inline bool Input_file::open(const string &path, bool read_all) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            map = static_cast<const char*>(m);
+            length = st.st_size;
         }
     }
-    return sum;
+    close(fd);
+    if (map || !read_all) return true;
+#endif
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) return false;
+    if (read_all) {
+        char block[1 << 16];
+        size_t n;
+        while ((n = fread(block, 1, sizeof(block), in)) > 0) copy.insert(copy.end(), block, block + n);
+    }
+    fclose(in);
+    return true;
 }
 
-/* Square root */
-double square_root() {
-    Token spe = statement();
-    return sqrt(spe.value);
+inline Input_file::~Input_file() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (map) munmap(const_cast<char*>(map), length);
+#endif
 }
 
-/* Logarithm */
-double logarithm(string s) {
-    double base;
-    try {
-        Token spe = statement();
-        if (s == "loge" || s == "log") {
-            return log(spe.value) / log(dict["e"]);  // log base change
+/* Call f(line, length) for every line of the file, mapped into memory where possible */
+template<class F>
+bool for_each_line(const string &path, F f) {
+    Input_file file;
+    if (!file.open(path, false)) return false;
+    if (file.mapped()) {
+        const char *p = file.data();
+        const char *end = p + file.size();
+        while (p < end) {
+            const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (!nl) nl = end;
+            bool more = f(p, size_t(nl - p));
+            p = nl + 1;
+            if (!more) break;
         }
-        else {
-            string subs = s.substr(3, s.size() - 3);
-            base = stod(subs);
-            return log(spe.value) / log(base);
-        }
-    }
-    catch (invalid_argument) {
-        error("No such variable \"" + s + "\""); return 1;
+        return true;
     }
-}
 
-/* Trigonometry */
-double trigonometry(string s) {
-    Token spe = statement();
-    if (s == "sin") {
-        double angle = spe.value * 180.0 / dict["pi"];
-        if (angle - 180.0 * int(angle / 180.0) == 0) return 0;  // otherwise STL returns a very small number instead of 0
-        else return sin(spe.value);
-    }
-    else if (s == "cos") {
-        double angle = spe.value * 180.0 / dict["pi"];
-        if (abs(angle - 180.0 * int(angle / 180.0)) == 90.0) return 0;
-        else return cos(spe.value);
-    }
-    else if (s == "tan") {
-        double angle = spe.value * 180.0 / dict["pi"];
-        if (angle - 180.0 * int(angle / 180.0) == 0) return 0;
-        else if (abs(angle - 180.0 * int(angle / 180.0)) == 90.0) error("Inf");
-        else return sin(spe.value) / cos(spe.value);
-    } 
-    else if (s == "cot") {
-        double angle = spe.value * 180.0 / dict["pi"];
-        if (angle - 180.0 * int(angle / 180.0) == 0) error("Inf");
-        else if (abs(angle - 180.0 * int(angle / 180.0)) == 90.0) return 0;
-        else return cos(spe.value) / sin(spe.value);
-    }
-    else if (s == "sind") {
-        if (spe.value - 180.0 * int(spe.value / 180.0) == 0) return 0;
-        else return sin(spe.value * dict["pi"] / 180.0);
-    }
-    else if (s == "cosd") {
-        if (abs(spe.value - 180.0 * int(spe.value / 180.0)) == 90.0) return 0;
-        else return cos(spe.value * dict["pi"] / 180.0);
-    }
-    else if (s == "tand") {
-        if (spe.value - 180.0 * int(spe.value / 180.0) == 0) return 0;
-        else if (abs(spe.value - 180.0 * int(spe.value / 180.0)) == 90.0) error("Inf");
-        else return sin(spe.value * dict["pi"] / 180) / cos(spe.value * dict["pi"] / 180);
-    }
-    else if (s == "cotd") {
-        if (spe.value - 180.0 * int(spe.value / 180.0) == 0) error("Inf");
-        else if (abs(spe.value - 180.0 * int(spe.value / 180.0)) == 90.0) return 0;
-        else return cos(spe.value * dict["pi"] / 180) / sin(spe.value * dict["pi"] / 180);
+    FILE *in = fopen(path.c_str(), "rb");  // pipes and empty files are read in blocks
+    if (!in) return false;
+    vector<char> block(1 << 20);
+    string carry;  // a line split between two blocks
+    size_t n;
+    bool more = true;
+    while (more && (n = fread(block.data(), 1, block.size(), in)) > 0) {
+        const char *p = block.data();
+        const char *end = p + n;
+        while (more && p < end) {
+            const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (!nl) {
+                carry.append(p, end);
+                break;
+            }
+            if (!carry.empty()) {
+                carry.append(p, nl);
+                more = f(carry.data(), carry.size());
+                carry.clear();
+            }
+            else more = f(p, size_t(nl - p));
+            p = nl + 1;
+        }
     }
-    else error("Wrong trignometry"); return 1;
+    if (more && !carry.empty()) f(carry.data(), carry.size());
+    fclose(in);
+    return true;
 }
 
-/* Generate a random number */
-double random_generator() {
-    random_device rd; 
-    mt19937 gen(rd()); 
-    gen.seed(chrono::high_resolution_clock::now().time_since_epoch().count()); 
-
-    Token spe = statement();
-    double lb = spe.value;
-    if (spe.key == comma) {
-        spe = statement();
-        double ub = spe.value; 
-        uniform_real_distribution <double> urd(lb, ub); 
-        return urd(gen);
+/* Is this line blank (1), the quit command (2) or a statement (0) */
+inline int line_type(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == ' ' || s[i] == '\t' || s[i] == '\r') continue;
+        return s[i] == quit ? 2 : 0;
     }
-    else {
-        uniform_real_distribution <double> urd(0, lb); 
-        return urd(gen);
-    } 
-}
-
-/* Switch special operations */
-double switch_operation(string s) {
-    if (s == "pi" || s == "e") return dict[s];
-    else if (s == "sqrt") return square_root();
-    else if (s.find("log") != string::npos) return logarithm(s);
-    else if (s == "sin" || s == "cos" || s == "tan" || s == "cot" || s == "sind" || s == "cosd" || s == "tand" || s == "cotd") return trigonometry(s);
-    else if (s == "rand") return random_generator();
-    else error("Cannot find this special operation"); return 1;
+    return 1;
 }
 
-//------------------------------------------------------------------------------
-
-// This section defines specific functions to deal with Tokens
-
-Token_stream ts;  // declare a Token_stream for function usage
-Token expression();  // primary() needs to know what is expression
-
-/* Deal with numbers, () and unary signs */
-double primary() {
-    Token t = ts.get_Token();
-    switch (t.key) {
-        case '(': {  // what's after '(' must be a number  
-            Token temp = statement();
-            double d = temp.value;  // read the number
-            t = ts.get_Token(); 
-            if (t.key != ')' && t.key != ',') error("')' expected");
-            else if (t.key == ',') ts.putback(t);  // put back so that expression() knows when to return the comma flag
-            return d;
-        }
-        case ',': {
-            Token temp = statement();
-            double d = temp.value;
-            t = ts.get_Token();
-            if (t.key != ')') error("')' expected");
-            return d;
-        }
-        case number: { 
-            return t.value;
-        }
-        case '+': {  // unary plus
-            t = ts.get_Token();
-            if (t.key == '+' || t.key == '-') {
-                error("more than 1 consecutive '+' or '-' makes no sense");
-            }
-            else {
-                ts.putback(t);
-                return primary();
-            }
-        }
-        case '-': {  // unary minus    
-            t = ts.get_Token();
-            if (t.key == '+' || t.key == '-') {
-                error("more than 1 consecutive '+' or '-' makes no sense");
-            }
-            else {
-                ts.putback(t);
-                return -primary();
-            }
+/* Evaluate one line of a batch file, definitions change the session */
+inline void batch_line(const char *s, size_t n, long line_no, Session &session, Out_buffer &out, long &errors, long &removed) {
+    Expected<Program> compiled = try_compile(string_view(s, n), session);  // bad lines are common, so no exception for them
+    if (!compiled) {
+        errors++;
+        out.flush();  // keep results and errors in order when both go to a terminal
+        fprintf(stderr, "Error: line %ld: %s\n", line_no, compiled.error().c_str());
+        return;
+    }
+    const Program &p = *compiled;
+    removed += p.removed;
+    try {
+        if (p.is_array) {  // every element on its own line
+            vector<double> result = run_array(p, session);
+            for (double x : result) out.write_number(x);
+            return;
         }
-        case special: {
-            double val = switch_operation(t.name);
-            return val;
+        string digits;
+        if (exact_result(p, session, digits)) {
+            session.assign(session.symbols.intern("ans"), evaluate(p, session));
+            digits += '\n';
+            out.write(digits.data(), digits.size());
+            return;
         }
-        default: {  // inputs must begin with a primary
-            ts.putback(t);
-            error("primary expected");
-            return 0;
+        double result = run(p, session);
+        if (p.target < 0) {
+            session.assign(session.symbols.intern("ans"), result);
+            out.write_number(result);
         }
     }
+    catch (exception &e) {
+        errors++;
+        out.flush();  // keep results and errors in order when both go to a terminal
+        fprintf(stderr, "Error: line %ld: %s\n", line_no, e.what());
+    }
 }
 
-/* deal with *, / and % */
-double term() {
-    double left = primary();  // left = number waiting to be operated
-    Token t = ts.get_Token(); 
-    Token temp;  // used for power operation
-    Token temp_rem;  // used for remainder with power operation
-
-    while(true) {
-        switch (t.key) {
-            case '*': {
-                double d = primary(); // always do primary before term
-                left *= d;  
-                temp = {t.key, d};
-                t = ts.get_Token();
-                break;  // see what's next operator
-            }
-            case '/': {
-                double d = primary();
-                if (d == 0) error("Inf");
-                left /= d;
-                temp = {t.key, d};
-                t = ts.get_Token();
-                break;
-            }
-            case '%': {
-                double d = primary();
-                if (d == 0) error("Inf");
-                temp_rem = {t.key, left};
-                left = left - d * int(left / d);
-                temp = {t.key, d};
-                t = ts.get_Token();
-                break;
-            }
-            case '^': {
-                double d = primary();  // exponential
-                switch (temp.key) {
-                    case '*': {
-                        left /= temp.value;  // undo * 
-                        left *= pow(temp.value, d);  // do power first then *
-                        break;
-                    }
-                    case '/': {
-                        left *= temp.value;
-                        left /= pow(temp.value, d);
-                        break;
-                    }
-                    case '%': {
-                        left = temp_rem.value;
-                        left = left - pow(temp.value, d) * int(left / pow(temp.value, d));
-                        break;
-                    }
-                    default: {
-                        left = pow(left, d);
-                        break;
-                    }
-                }
-                t = ts.get_Token();
-                break;
-            }
-            case '!': {
-                if ((temp.key == '*' || temp.key == '/' || temp.key == '%') && (temp.value - int(temp.value) != 0)) error("Only integers have factorial");  // a*b!, b is not integer
-                else if (temp.key != '*' && temp.key != '/' && temp.key != '%' && left - int(left) != 0) error("Only integers have factorial");  // c!, c is not integer
-
-                switch (temp.key) {
-                    case '*': {
-                        left /= temp.value;  // undo * 
-                        left *= factorial(temp.value);  // do ! first then *
-                        break;
-                    }
-                    case '/': {
-                        left *= temp.value;
-                        left /= factorial(temp.value);
-                        break;
-                    }
-                    case '%': {
-                        left = temp_rem.value;
-                        left = left - factorial(temp.value) * int(left / factorial(temp.value));
-                        break;
-                    }
-                    default: {
-                        left = factorial(left);
-                        break;
-                    }
-                }
-                t = ts.get_Token();
-                break;
-            }
-            default: {
-                ts.putback(t); // do term first, then do expression
-                return left;
-            }
-        }
+/* Evaluate one statement per line of a file, results go to stdout and errors to stderr */
+int batch(const string &path, Session &session) {
+    Out_buffer out(stdout);
+    long lines = 0, errors = 0, removed = 0;
+    auto t0 = chrono::steady_clock::now();
+
+    bool opened = for_each_line(path, [&](const char *s, size_t n) {
+        lines++;
+        int type = line_type(s, n);
+        if (type == 0) batch_line(s, n, lines, session, out, errors, removed);
+        return type != 2;
+    });
+    out.flush();
+    if (!opened) {
+        cerr << "Error: cannot open \"" << path << "\"\n";
+        return 1;
     }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    fprintf(stderr, "%ld lines, %ld errors, %ld nodes optimized away, %.3f s, %.0f lines/sec\n", lines, errors, removed, seconds, lines / max(seconds, 1e-9));
+    return errors ? 1 : 0;
 }
 
-/* deal with + and - */
-Token expression() {
-    double left = term();  
-    Token t = ts.get_Token(); 
+/* Lines evaluated by one task of the parallel batch mode, with their output */
+struct Batch_chunk
+{
+    const char *begin;
+    const char *end;
+    long first_line;
+    string out;
+    string err;
+    long errors {0};
+    long removed {0};  // by the optimizer
+    bool done {false};
+};
 
-    while(true) {    
-        switch(t.key) {
-            case '+': {
-                left += term();  // always do term before expression
-                t = ts.get_Token();
-                break;
+/* Evaluate the expressions of a chunk against a session that nobody changes meanwhile */
+inline void batch_chunk(Batch_chunk &c, const Session &session) {
+    char number[32];
+    long line_no = c.first_line;
+    for (const char *p = c.begin; p < c.end; line_no++) {
+        const char *nl = static_cast<const char*>(memchr(p, '\n', c.end - p));
+        if (!nl) nl = c.end;
+        if (line_type(p, nl - p) == 0) {
+            Expected<Program> compiled = try_compile(string_view(p, nl - p), session);
+            if (!compiled) {
+                c.errors++;
+                c.err += "Error: line " + to_string(line_no) + ": " + compiled.error() + "\n";
+                p = nl + 1;
+                continue;
             }
-            case '-': {
-                left -= term(); 
-                t = ts.get_Token();
-                break;
-            }
-            case ',': { 
-                ts.putback(t);
-                return Token(comma, left);  // return a Token with the "comma" flag
+            const Program &prog = *compiled;
+            c.removed += prog.removed;
+            try {
+                string digits;
+                if (exact_result(prog, session, digits)) c.out += digits + '\n';
+                else if (prog.is_array) {
+                    for (double x : evaluate_array(prog, session)) c.out.append(number, format_number(number, x));
+                }
+                else c.out.append(number, format_number(number, evaluate(prog, session)));
             }
-            default: {
-                ts.putback(t);  
-                return Token(caled, left);  // update result.key
+            catch (exception &e) {
+                c.errors++;
+                c.err += "Error: line " + to_string(line_no) + ": " + e.what() + "\n";
             }
         }
+        p = nl + 1;
     }
 }
 
-/* Deal with variables */
-Token statement() {
-    Token t = ts.get_Token();
-
-    switch (t.key) {
-        case define: {  // if define a new variable
-            Token temp = statement();
-            dict[t.name] = temp.value;
-            cout << "Variable \"" << t.name << "\" is defined\n";
-            cout << display_line(100);
-            return 0; break;
-        }
-        default: {
-            ts.putback(t);
-            return expression();
+/* Does the line call rand or seed, whose numbers depend on the order in which lines run */
+inline bool uses_random(const char *s, size_t n) {
+    string_view line(s, n);
+    for (string_view name : {string_view("rand"), string_view("seed")}) {
+        for (size_t i = line.find(name); i != string_view::npos; i = line.find(name, i + 1)) {
+            size_t after = i + name.size();
+            if ((i == 0 || !is_name_char(line[i - 1])) && (after == n || !is_name_char(line[after]))) return true;
         }
     }
+    return false;
 }
 
-/* Read inputs, calculates then print */
-void calculate() {
-    Token result;
-    while (cin) {
-        try {
-            Token t = ts.get_Token();
-            if (t.key == quit) break;
-            if (t.key == print && result.key == caled) {  // print calculation result
-                dict["ans"] = result.value;  // so that ans can be used like MATLAB
-                cout << result.value << '\n';  
-                cout << display_line(100);
-                result.key = 'd';
+/* Batch mode spread over a thread pool. Lines between two definitions are independent, so they
+   are cut into chunks evaluated in parallel; a definition waits for them and then runs alone.
+   So does a line drawing random numbers, every thread has an engine of its own and seed(n)
+   only repeats a run when the numbers are drawn in input order. Output is written in input order. */
+int batch_parallel(const string &path, Session &session, unsigned threads) {
+    const long chunk_lines = 1024;
+    Input_file file;
+    if (!file.open(path, true)) {
+        cerr << "Error: cannot open \"" << path << "\"\n";
+        return 1;
+    }
+    auto t0 = chrono::steady_clock::now();
+    Thread_pool pool(threads);
+    const size_t window = pool.size() * 4;  // chunks in flight, enough to keep every worker busy
+    Out_buffer out(stdout);
+    deque<Batch_chunk> chunks;  // in input order, references stay valid while the deque grows
+    mutex m;
+    condition_variable cv;
+    long lines = 0, errors = 0, removed = 0;
+
+    auto write_until = [&](size_t left) {  // write finished chunks in order until only left remain
+        while (chunks.size() > left) {
+            Batch_chunk &c = chunks.front();
+            {
+                unique_lock<mutex> lock(m);
+                cv.wait(lock, [&] { return c.done; });
             }
-            else if (t.key == print && result.key != caled) {}  // if user keeps pressing Enter for fun or habit
-            else {
-                ts.putback(t);
-                result = statement();
+            out.write(c.out.data(), c.out.size());
+            if (!c.err.empty()) {
+                out.flush();
+                fputs(c.err.c_str(), stderr);
             }
+            errors += c.errors;
+            removed += c.removed;
+            chunks.pop_front();
         }
-        catch (exception &e) {
-            cerr << "Error: " << e.what() << '\n';
-            ts.reset();
+    };
+    auto submit = [&](const char *begin, const char *end, long first_line) {
+        if (begin == end) return;
+        chunks.push_back({begin, end, first_line, "", "", 0, 0, false});
+        Batch_chunk &c = chunks.back();
+        const Session &shared = session;
+        pool.submit([&c, &shared, &m, &cv] {
+            batch_chunk(c, shared);
+            lock_guard<mutex> lock(m);
+            c.done = true;
+            cv.notify_all();
+        });
+        write_until(window);
+    };
+
+    const char *p = file.data();
+    const char *end = p + file.size();
+    const char *begin = p;  // start of the chunk being collected
+    long first_line = 1;
+    while (p < end) {
+        const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!nl) nl = end;
+        lines++;
+        int type = line_type(p, nl - p);
+        if (type == 2) {  // quit
+            submit(begin, p, first_line);
+            break;
         }
+        if (type == 0 && (memchr(p, '=', nl - p) || uses_random(p, nl - p))) {  // a definition, which the following lines may use
+            submit(begin, p, first_line);
+            write_until(0);
+            batch_line(p, nl - p, lines, session, out, errors, removed);
+            session.update();  // the chunks only read the session
+            begin = nl + 1;
+            first_line = lines + 1;
+        }
+        else if (lines - first_line + 1 == chunk_lines) {
+            submit(begin, min(nl + 1, end), first_line);
+            begin = nl + 1;
+            first_line = lines + 1;
+        }
+        p = nl + 1;
     }
+    if (p >= end) submit(begin, min(p, end), first_line);
+    write_until(0);
+    out.flush();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    fprintf(stderr, "%ld lines, %ld errors, %ld nodes optimized away, %.3f s, %.0f lines/sec on %zu threads\n", lines, errors, removed, seconds, lines / max(seconds, 1e-9), pool.size());
+    return errors ? 1 : 0;
 }
 
 //------------------------------------------------------------------------------
 
-int main() try
+int main(int argc, char *argv[]) try
 {
+    string batch_file, socket_path;
+    int threads = -1;  // -1 evaluates the batch file on this thread only
+    int port = 0;
+    bool exact = false, optimize = true;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if ((arg == "-b" || arg == "--batch") && i + 1 < argc) batch_file = argv[++i];  // calculator -b file
+        else if ((arg == "-j" || arg == "--threads") && i + 1 < argc) threads = max(0, atoi(argv[++i]));  // 0 uses every core
+        else if (arg == "--rng" && i + 1 < argc && parse_generator(argv[i + 1], default_generator)) {  // --rng xoshiro|pcg|mt
+            rng.use(default_generator);
+            i++;
+        }
+        else if (arg == "--exact") exact = true;  // integer results with all their digits
+        else if (arg == "--no-optimize") optimize = false;  // statements that run once gain little from the optimizer
+        else if (arg == "--stats") atexit(show_stats_at_exit);  // the #stats table on stderr when the program ends
+        else if (arg == "--socket" && i + 1 < argc) socket_path = argv[++i];  // serve clients on a Unix domain socket
+        else if (arg == "--port" && i + 1 < argc) port = atoi(argv[++i]);     // or on a TCP port of 127.0.0.1
+        else {
+            cerr << "Usage: " << argv[0] << " [-b file [-j threads]] [--socket path | --port n [-j threads]] [--rng xoshiro|pcg|mt] [--exact] [--no-optimize] [--stats]\n";
+            return 1;
+        }
+    }
+    Session session;
+    session.exact = exact;
+    session.optimize = optimize;
+    if (!batch_file.empty()) {
+        if (threads >= 0) return batch_parallel(batch_file, session, threads ? threads : thread::hardware_concurrency());
+        return batch(batch_file, session);
+    }
+    if (!socket_path.empty() || port > 0) {
+#if defined(__linux__)
+        Server server(session);
+        if (!(socket_path.empty() ? server.listen_tcp(port) : server.listen_unix(socket_path))) {
+            cerr << "Error: cannot listen on " << (socket_path.empty() ? "port " + to_string(port) : "\"" + socket_path + "\"") << ": " << strerror(errno) << '\n';
+            return 1;
+        }
+        return server.serve(threads > 0 ? threads : threads == 0 ? thread::hardware_concurrency() : 1);
+#else
+        cerr << "Error: the server mode needs Linux\n";
+        return 1;
+#endif
+    }
+
     cout << "Welcome to Stroustrup-n33 calculator (version 1.0), the syntaxes should be intuition-friendly and MATLAB-alike." << endl;
-    cout << "1. Available operators are +, -, /, *, %, ^, !, sqrt." << endl;
+    cout << "1. Available operators are +, -, /, *, %, ^, !, sqrt, gamma, lgamma." << endl;
     cout << "2. Define variable format: s = 1 or s = d, space can be ignored." << endl;
     cout << "3. Logarithm syntax: log3(10), where 3 is the base and 10 is exponent; To calculate natural log, use log or loge." << endl;
     cout << "4. Trigonometry syntax: same as MATLAB." << endl;
-    cout << "5. Random number format: rand(10) uniformly from 0-10, rand(1, 4) uniformaly from 1-4." << endl;
+    cout << "5. Random number format: rand(10) uniformly from 0-10, rand(1, 4) uniformaly from 1-4, rand(1, 4, 100) gives 100 of them; seed(n) repeats a run." << endl;
     cout << "6. Add parentheses when combining special operations with ^ or !." << endl;
     cout << "7. Complex numbers are returned as nan." << endl;
     cout << "8. Currently support 2 constants: pi, e." << endl;
+    cout << "9. Arrays: x = linspace(0, 1, 100), operators and special operations then apply element-wise." << endl;
+    cout << "10. n! and gamma(x) take any number; #exact prints integer results such as 10000! with all their digits." << endl;
+    cout << "11. Reductions: sum(i, 1, 1e9, 1/i^2), and likewise prod, min and max, run over every core." << endl;
+    cout << "12. #stats shows where the time goes so far, #stats reset starts counting again." << endl;
+    cout << "13. Derivatives: grad(x^2 * y, x, y) gives both partial derivatives exactly, in one pass." << endl;
     cout << display_line(100) << display_line(100);
 
     cout.precision(7);
-    init_const();
 
     while (true) {
-        calculate();
+        calculate(session);
         return 0;
     }
 }
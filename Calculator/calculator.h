@@ -0,0 +1,2080 @@
+/*
+Calculator engine: Token_stream, compiler and evaluator used by calculator.cpp
+
+A statement is compiled once into a small stack-machine Program and can then be
+run any number of times. Variables are bound when compiling, so a parameter sweep
+only has to update the variable and call run() again:
+
+    Session session;
+    int x = session.symbols.intern("x");
+    session.symbols.set(x, 0);
+    Program p = compile("sin(x) * 2 + x^2", session);
+    for (...) { session.symbols.values[x] = ...; double y = run(p, session); }
+
+Array variables (x = linspace(0, 1, 1e7)) are evaluated element-wise by
+run_array(), a block at a time with the SIMD kernels from simd.h. A Program
+keeps the kind (number or array) each name had when it was compiled. Reductions
+such as sum(i, 1, 1e9, 1/i^2) run their body the same way, over every core.
+grad(x^2 * y, x, y) runs its body once on dual numbers, see gradient().
+
+A definition (a = b * 2) keeps its Program, so after b changes, a is recomputed
+the next time a statement uses it; see Session::define(). Writing values[] directly
+as above skips this, use session.assign() when definitions depend on the variable.
+
+Lexing, the grammar levels, evaluation, builtins, name lookups and error() count
+into the per-thread blocks of stats.h, shown by #stats; -DCALCULATOR_STATS=0 removes it.
+
+All state lives in a Session. Compiling against a const Session never adds
+names, and evaluate() never assigns, so any number of threads can share one
+Session while nobody defines variables in it.
+
+n33 (2019.5.19)
+*/
+
+#ifndef CALCULATOR_H
+#define CALCULATOR_H
+
+#define _USE_MATH_DEFINES  // to use M_PI, M_E
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <string_view>
+#include <charconv>
+#include <map>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include "bigint.h"
+#include "random.h"
+#include "simd.h"
+#include "stats.h"
+#include "thread_pool.h"
+using namespace std;
+
+//------------------------------------------------------------------------------
+
+// This section contains some operational-use functions
+
+/* Display error */
+[[noreturn]] inline void error(string message)
+{
+    STATS_COUNT(Stat::error);
+    throw runtime_error(message);
+}
+
+/* An error reported by returning it, see Expected */
+struct Unexpected
+{
+    string message;
+};
+
+/* A value or the error that prevented it, for paths where throwing costs too much */
+template<class T>
+class Expected
+{
+    private:
+        T val {};
+        string message;
+        bool ok {true};
+    public:
+        Expected(T v): val(move(v)) {}
+        Expected(Unexpected e): message(move(e.message)), ok(false) {}
+        explicit operator bool() const { return ok; }
+        T &operator*() { return val; }
+        const T &operator*() const { return val; }
+        T *operator->() { return &val; }
+        const T *operator->() const { return &val; }
+        const string &error() const { return message; }
+};
+
+/* Create separation line in terminal window */
+inline string display_line(int n) {
+    string s;
+    for (int i = 0; i < n ; i++) {
+        s += "-";  // the separation line consists of multiple '-' symbols
+    }
+    s += '\n';
+    return s;
+}
+
+//------------------------------------------------------------------------------
+
+// This section contains some preliminary declarations
+const char print = '\n';  // press Enter to calculate
+const char quit = '$';  // use $ because it cannot be a name
+const char number = 'n';
+const char variable = 'v';  // a variable name, resolved when compiling
+const char define = '@';
+const char special = '#';  // special operation
+const char bad = '?';  // could not be read, Token_stream::error() says why
+
+//------------------------------------------------------------------------------
+
+// This section defines some special operations
+
+/* 0! to 170!, each the double nearest to the exact value, 171! overflows a double */
+constexpr double factorials[] = {
+    1.0, 1.0, 2.0, 6.0, 24.0, 120.0, 720.0, 5040.0, 40320.0, 362880.0, 3628800.0, 39916800.0,
+    479001600.0, 6227020800.0, 87178291200.0, 1307674368000.0, 20922789888000.0, 355687428096000.0,
+    6402373705728000.0, 1.21645100408832e+17, 2.43290200817664e+18, 5.109094217170944e+19,
+    1.1240007277776077e+21, 2.585201673888498e+22, 6.204484017332394e+23, 1.5511210043330986e+25,
+    4.0329146112660565e+26, 1.0888869450418352e+28, 3.0488834461171387e+29, 8.841761993739702e+30,
+    2.6525285981219107e+32, 8.222838654177922e+33, 2.631308369336935e+35, 8.683317618811886e+36,
+    2.9523279903960416e+38, 1.0333147966386145e+40, 3.7199332678990125e+41, 1.3763753091226346e+43,
+    5.230226174666011e+44, 2.0397882081197444e+46, 8.159152832478977e+47, 3.345252661316381e+49,
+    1.40500611775288e+51, 6.041526306337383e+52, 2.658271574788449e+54, 1.1962222086548019e+56,
+    5.502622159812089e+57, 2.5862324151116818e+59, 1.2413915592536073e+61, 6.082818640342675e+62,
+    3.0414093201713376e+64, 1.5511187532873822e+66, 8.065817517094388e+67, 4.2748832840600255e+69,
+    2.308436973392414e+71, 1.2696403353658276e+73, 7.109985878048635e+74, 4.0526919504877214e+76,
+    2.3505613312828785e+78, 1.3868311854568984e+80, 8.32098711274139e+81, 5.075802138772248e+83,
+    3.146997326038794e+85, 1.98260831540444e+87, 1.2688693218588417e+89, 8.247650592082472e+90,
+    5.443449390774431e+92, 3.647111091818868e+94, 2.4800355424368305e+96, 1.711224524281413e+98,
+    1.1978571669969892e+100, 8.504785885678623e+101, 6.1234458376886085e+103,
+    4.4701154615126844e+105, 3.307885441519386e+107, 2.48091408113954e+109,
+    1.8854947016660504e+111, 1.4518309202828587e+113, 1.1324281178206297e+115,
+    8.946182130782976e+116, 7.156945704626381e+118, 5.797126020747368e+120, 4.753643337012842e+122,
+    3.945523969720659e+124, 3.314240134565353e+126, 2.81710411438055e+128, 2.4227095383672734e+130,
+    2.107757298379528e+132, 1.8548264225739844e+134, 1.650795516090846e+136,
+    1.4857159644817615e+138, 1.352001527678403e+140, 1.2438414054641308e+142,
+    1.1567725070816416e+144, 1.087366156656743e+146, 1.032997848823906e+148,
+    9.916779348709496e+149, 9.619275968248212e+151, 9.426890448883248e+153, 9.332621544394415e+155,
+    9.332621544394415e+157, 9.42594775983836e+159, 9.614466715035127e+161, 9.90290071648618e+163,
+    1.0299016745145628e+166, 1.081396758240291e+168, 1.1462805637347084e+170,
+    1.226520203196138e+172, 1.324641819451829e+174, 1.4438595832024937e+176,
+    1.588245541522743e+178, 1.7629525510902446e+180, 1.974506857221074e+182,
+    2.2311927486598138e+184, 2.5435597334721877e+186, 2.925093693493016e+188,
+    3.393108684451898e+190, 3.969937160808721e+192, 4.684525849754291e+194, 5.574585761207606e+196,
+    6.689502913449127e+198, 8.094298525273444e+200, 9.875044200833601e+202, 1.214630436702533e+205,
+    1.506141741511141e+207, 1.882677176888926e+209, 2.372173242880047e+211,
+    3.0126600184576594e+213, 3.856204823625804e+215, 4.974504222477287e+217,
+    6.466855489220474e+219, 8.47158069087882e+221, 1.1182486511960043e+224,
+    1.4872707060906857e+226, 1.9929427461615188e+228, 2.6904727073180504e+230,
+    3.659042881952549e+232, 5.012888748274992e+234, 6.917786472619489e+236, 9.615723196941089e+238,
+    1.3462012475717526e+241, 1.898143759076171e+243, 2.695364137888163e+245,
+    3.854370717180073e+247, 5.5502938327393044e+249, 8.047926057471992e+251,
+    1.1749972043909107e+254, 1.727245890454639e+256, 2.5563239178728654e+258,
+    3.80892263763057e+260, 5.713383956445855e+262, 8.62720977423324e+264, 1.3113358856834524e+267,
+    2.0063439050956823e+269, 3.0897696138473508e+271, 4.789142901463394e+273,
+    7.471062926282894e+275, 1.1729568794264145e+278, 1.853271869493735e+280,
+    2.9467022724950384e+282, 4.7147236359920616e+284, 7.590705053947219e+286,
+    1.2296942187394494e+289, 2.0044015765453026e+291, 3.287218585534296e+293,
+    5.423910666131589e+295, 9.003691705778438e+297, 1.503616514864999e+300,
+    2.5260757449731984e+302, 4.269068009004705e+304, 7.257415615307999e+306
+};
+
+/* Factorial, looked up for integers and the gamma function for other numbers */
+inline double factorial(double n) {
+    if (n - floor(n) != 0) return tgamma(n + 1);  // also passes inf and nan on
+    if (n < 0) error("Inf");  // the poles of the gamma function
+    if (n >= size(factorials)) return HUGE_VAL;
+    return factorials[int(n)];
+}
+
+/* x^k for an integer k by repeated squaring, what constant integer powers are optimized into */
+inline double power_int(double x, long k) {
+    double r = 1;
+    for (unsigned long e = k < 0 ? 0 - (unsigned long)k : (unsigned long)k; e; e >>= 1) {
+        if (e & 1) r *= x;
+        x *= x;
+    }
+    return k < 0 ? 1 / r : r;
+}
+
+/* Square root */
+inline double square_root(double x) {
+    return sqrt(x);
+}
+
+/* Natural logarithm, other bases are divided by log(base) when compiling */
+inline double logarithm(double x) {
+    return log(x);
+}
+
+/* Trigonometry in radians, exactly 0 where x / M_PI - offset is an integer: the double nearest
+   a multiple of pi/2 and the few around it. |k| < 2^51 leaves k 2 or more fraction bits, past
+   that half of all doubles would count. Only + - * /, so formula.h runs it in the compiler too. */
+constexpr bool near_multiple_of_pi(double x, double offset) {
+    double k = x / M_PI - offset;
+    return k < 0x1p51 && k > -0x1p51 && k == (k + 0x1.8p52) - 0x1.8p52;  // k rounded to an integer
+}
+
+inline double sine(double x) {
+    return near_multiple_of_pi(x, 0) ? 0 : sin(x);  // otherwise STL returns a very small number instead of 0
+}
+
+inline double cosine(double x) {
+    return near_multiple_of_pi(x, 0.5) ? 0 : cos(x);
+}
+
+inline double tangent(double x) {
+    if (near_multiple_of_pi(x, 0)) return 0;
+    if (near_multiple_of_pi(x, 0.5)) error("Inf");
+    return tan(x);
+}
+
+inline double cotangent(double x) {
+    if (near_multiple_of_pi(x, 0)) error("Inf");
+    if (near_multiple_of_pi(x, 0.5)) return 0;
+    return 1 / tan(x);
+}
+
+/* Trigonometry in degrees, see sincos_deg() in simd.h */
+inline double sine_deg(double x) {
+    double s, c;
+    sincos_deg(x, s, c);
+    return s;
+}
+
+inline double cosine_deg(double x) {
+    double s, c;
+    sincos_deg(x, s, c);
+    return c;
+}
+
+inline double tangent_deg(double x) {
+    double s, c;
+    sincos_deg(x, s, c);
+    if (c == 0) error("Inf");
+    return s / c;
+}
+
+inline double cotangent_deg(double x) {
+    double s, c;
+    sincos_deg(x, s, c);
+    if (s == 0) error("Inf");
+    return c / s;
+}
+
+/* Gamma function, gamma(n + 1) = n! */
+inline double gamma_function(double x) {
+    if (x <= 0 && x == floor(x)) error("Inf");
+    return tgamma(x);
+}
+
+/* Logarithm of |gamma(x)|, finite long after gamma(x) overflows */
+inline double log_gamma(double x) {
+    if (x <= 0 && x == floor(x)) error("Inf");
+    return lgamma(x);
+}
+
+/* Generate a random number uniformly from lb to ub */
+inline double random_generator(double lb, double ub) {
+    return rng.uniform(lb, ub);
+}
+
+/* rand(ub) draws from 0 to ub */
+inline double random_upper(double ub) {
+    return random_generator(0, ub);
+}
+
+/* seed(n) restarts the random numbers of this thread from n */
+inline double random_seed(double n) {
+    if (n < 0 || n - floor(n) != 0) error("seed must be a non-negative integer");
+    rng.seed(uint64_t(n));
+    return n;
+}
+
+/* How a special operation is compiled */
+enum class Builtin_type : unsigned char
+{
+    constant,     // pushes value
+    function,     // calls fn1 or fn2 depending on the number of arguments
+    linspace,     // compiled to Op::linspace
+    reduction,    // sum(i, first, last, expression) and the like, compiled to Op::reduce
+    gradient,     // grad(expression, x, y), compiled to Op::grad
+    unavailable,  // reserved name
+};
+
+/* A special operation, the one and two argument forms can both exist as for rand */
+struct Builtin
+{
+    const char *name;
+    Builtin_type type;
+    double value;
+    double (*fn1)(double);
+    double (*fn2)(double, double);
+};
+
+constexpr Builtin builtins[] = {
+    {"pi", Builtin_type::constant, M_PI, nullptr, nullptr},
+    {"e", Builtin_type::constant, M_E, nullptr, nullptr},
+    {"inf", Builtin_type::unavailable, 0, nullptr, nullptr},
+    {"sqrt", Builtin_type::function, 0, square_root, nullptr},
+    {"log", Builtin_type::function, 0, logarithm, nullptr},
+    {"loge", Builtin_type::function, 0, logarithm, nullptr},
+    {"sin", Builtin_type::function, 0, sine, nullptr},
+    {"cos", Builtin_type::function, 0, cosine, nullptr},
+    {"tan", Builtin_type::function, 0, tangent, nullptr},
+    {"cot", Builtin_type::function, 0, cotangent, nullptr},
+    {"sind", Builtin_type::function, 0, sine_deg, nullptr},
+    {"cosd", Builtin_type::function, 0, cosine_deg, nullptr},
+    {"tand", Builtin_type::function, 0, tangent_deg, nullptr},
+    {"cotd", Builtin_type::function, 0, cotangent_deg, nullptr},
+    {"gamma", Builtin_type::function, 0, gamma_function, nullptr},
+    {"lgamma", Builtin_type::function, 0, log_gamma, nullptr},
+    {"rand", Builtin_type::function, 0, random_upper, random_generator},  // rand(lb, ub, n) is Op::rand_array
+    {"seed", Builtin_type::function, 0, random_seed, nullptr},
+    {"linspace", Builtin_type::linspace, 0, nullptr, nullptr},
+    {"sum", Builtin_type::reduction, 0, nullptr, nullptr},
+    {"prod", Builtin_type::reduction, 0, nullptr, nullptr},
+    {"min", Builtin_type::reduction, 0, nullptr, nullptr},
+    {"max", Builtin_type::reduction, 0, nullptr, nullptr},
+    {"grad", Builtin_type::gradient, 0, nullptr, nullptr},
+};
+
+const int builtin_slots = 64;
+
+/* Perfect hash of the names in builtins[], the multiplier was searched so that no two collide */
+constexpr unsigned builtin_hash(string_view s) {
+    unsigned h = 0;
+    for (char c : s) h = h * 611 + (unsigned char)c;
+    return (h ^ (h >> 5)) % builtin_slots;
+}
+
+/* Position in builtins[] for every hash value, -1 for an empty slot */
+struct Builtin_index
+{
+    int slot[builtin_slots];
+    bool perfect;
+};
+
+constexpr Builtin_index make_builtin_index() {
+    Builtin_index index {{}, true};
+    for (int &i : index.slot) i = -1;
+    for (int i = 0; i < int(size(builtins)); i++) {
+        int &slot = index.slot[builtin_hash(builtins[i].name)];
+        if (slot != -1) index.perfect = false;
+        slot = i;
+    }
+    return index;
+}
+
+constexpr Builtin_index builtin_index = make_builtin_index();
+static_assert(builtin_index.perfect, "two builtin names have the same hash, search another multiplier");
+
+/* Position of a special operation in builtins[], -1 if s is not one */
+constexpr int find_builtin(string_view s) {
+    int i = builtin_index.slot[builtin_hash(s)];
+    return (i >= 0 && s == builtins[i].name) ? i : -1;
+}
+
+constexpr int log_builtin = find_builtin("log");
+constexpr int rand_builtin = find_builtin("rand");
+constexpr int seed_builtin = find_builtin("seed");
+constexpr int sum_builtin = find_builtin("sum");
+constexpr int prod_builtin = find_builtin("prod");
+constexpr int min_builtin = find_builtin("min");
+
+//------------------------------------------------------------------------------
+
+// This section contains the symbol table
+
+/* What a name stands for */
+enum class Kind : unsigned char
+{
+    undefined,  // seen but never defined
+    number,
+    array,
+    builtin,    // builtins[builtin[slot]]
+    logarithm,  // logN, values[slot] holds log(N)
+};
+
+/* Every name gets an integer slot the first time it is seen, after that only slots are used */
+class Symbol_table
+{
+    private:
+        vector<int> slots = vector<int>(64, -1);  // open addressing on the hash of the name, -1 where empty, at most half full
+
+        size_t position(string_view name) const;
+        void grow();
+    public:
+        vector<string> names;
+        vector<Kind> kinds;
+        vector<double> values;          // numbers, indexed by slot
+        vector<vector<double>> arrays;  // array variables, indexed by slot
+        vector<int> builtin;            // position in builtins[], -1 for other names
+
+        static Kind classify(string_view name, int &builtin, double &value);
+        int intern(string_view name);
+        int find(string_view name) const;  // -1 if never seen
+        void set(int slot, double val);
+        void set_array(int slot, vector<double> &&a);
+};
+
+/* What a name means before anything is defined, value is log(N) for logN */
+inline Kind Symbol_table::classify(string_view name, int &builtin, double &value) {
+    builtin = find_builtin(name);
+    value = 0;
+    if (builtin >= 0) return Kind::builtin;
+    if (name.size() > 3 && name.substr(0, 3) == "log") {  // if a logarithm, logN(x) = log(x) / log(N)
+        double base;
+        const char *end = name.data() + name.size();
+        auto [used, ec] = from_chars(name.data() + 3, end, base);
+        if (ec == errc() && used == end) {  // otherwise an ordinary name such as logx
+            value = log(base);
+            return Kind::logarithm;
+        }
+    }
+    return Kind::undefined;
+}
+
+/* Where name is in slots, or the empty entry where it goes. The entries hold slots and not
+   names, so finding a string_view allocates nothing and a copied table needs no fixing up. */
+inline size_t Symbol_table::position(string_view name) const {
+    size_t mask = slots.size() - 1;
+    size_t i = hash<string_view>()(name) & mask;
+    while (slots[i] >= 0 && names[slots[i]] != name) i = (i + 1) & mask;
+    return i;
+}
+
+inline void Symbol_table::grow() {
+    slots.assign(slots.size() * 2, -1);
+    for (int slot = 0; slot < int(names.size()); slot++) slots[position(names[slot])] = slot;
+}
+
+inline int Symbol_table::intern(string_view name) {
+    STATS_COUNT(Stat::lookup);
+    size_t i = position(name);
+    if (slots[i] >= 0) return slots[i];
+    STATS_COUNT(Stat::lookup_miss);
+
+    int slot = int(names.size());
+    int b;
+    double val;
+    slots[i] = slot;
+    names.emplace_back(name);
+    kinds.push_back(classify(name, b, val));
+    values.push_back(val);
+    arrays.emplace_back();
+    builtin.push_back(b);
+    if (names.size() * 2 > slots.size()) grow();
+    return slot;
+}
+
+inline int Symbol_table::find(string_view name) const {
+    STATS_COUNT(Stat::lookup);
+    size_t i = position(name);
+    if (slots[i] < 0) {
+        STATS_COUNT(Stat::lookup_miss);
+        return -1;
+    }
+    return slots[i];
+}
+
+inline void Symbol_table::set(int slot, double val) {
+    kinds[slot] = Kind::number;
+    values[slot] = val;
+    vector<double>().swap(arrays[slot]);  // free an array defined earlier under this name
+}
+
+inline void Symbol_table::set_array(int slot, vector<double> &&a) {
+    kinds[slot] = Kind::array;
+    arrays[slot] = move(a);
+}
+
+//------------------------------------------------------------------------------
+
+// This section contains the calculator session
+
+struct Program;
+
+/* How a variable was defined: its formula, which is recomputed when one of its inputs changes */
+struct Definition
+{
+    shared_ptr<const Program> formula;  // null for a plain value
+    vector<int> inputs;                 // slots the formula loads
+    vector<int> users;                  // slots whose formulas load this one
+    bool stale {false};                 // an input changed since the value was computed
+    string failure;                     // why it could not be recomputed, while stale
+};
+
+/* Everything one calculator needs, sessions are independent of each other */
+class Session
+{
+    private:
+        vector<Definition> definitions;  // indexed by slot, the dependency graph between variables
+
+        Definition &definition(int slot);
+        void unlink(int slot);
+        int used_by(int slot, const vector<int> &slots);
+        void recompute(int slot);
+    public:
+        Symbol_table symbols;  // stores variables and the names of special operations
+        bool exact {false};    // print integer results with all their digits, see evaluate_exact()
+        bool optimize {true};  // run optimize() on compiled statements, except in the exact mode
+        Session();
+
+        void define(const Program &p);           // p becomes the formula of p.target, errors on a cycle
+        void assign(int slot, double val);       // a plain value, replacing any formula
+        void changed(int slot);                  // marks every variable computed from slot as stale
+        void update(const Program &p);           // recomputes the stale variables p loads
+        void update();                           // recomputes every stale variable
+        bool is_stale(int slot) const { return size_t(slot) < definitions.size() && definitions[slot].stale; }
+        const string &failure(int slot) const { return definitions[slot].failure; }
+};
+
+/* Intern the names of special operations so they take the first slots */
+inline Session::Session() {
+    for (const Builtin &b : builtins) symbols.intern(b.name);
+}
+
+//------------------------------------------------------------------------------
+
+// This section contains the calculator Token class
+
+/* Token is a user-defined type for whatever the user inputs for calculation */
+class Token
+{
+    public:
+        char key;
+        double value;
+        string_view name;  // points into the statement
+        int slot {-1};
+        Token(): key('d'), value(1) {}  // default Token constructor, 1 because *1, /1 = 1
+        Token(char ch): key(ch), value(0) {}  // make a Token from a symbol
+        Token(char ch, double val): key(ch), value(val) {}  // make a Token from a number
+        Token(char ch, string_view s, int n): key(ch), value(0), name(s), slot(n) {}  // make a Token from a name
+};
+
+/* Reads Tokens straight out of one statement, without copying it or throwing */
+class Token_stream
+{
+    private:
+        string_view s;
+        size_t pos {0};       // where the next Token starts
+        const Symbol_table &table;
+        Symbol_table *names;  // new names are interned here, nullptr to leave the table untouched
+        Token next;           // the Token at pos when has_next, so peek() then get_Token() reads it once
+        bool has_next {false};
+        string failure;       // first error, the stream then only returns bad Tokens
+        Stats_batch stats;
+
+        Token read();
+        Token fail(string message);
+    public:
+        Token_stream(string_view text, const Symbol_table &t, Symbol_table *n): s(text), table(t), names(n) {}
+        Token get_Token();            // get a Token
+        Token peek(size_t k = 0);     // the Token k places ahead, without using it up
+        const string &error() const { return failure; }
+};
+
+inline Token Token_stream::fail(string message) {
+    if (failure.empty()) failure = move(message);
+    pos = s.size();
+    return Token(bad);
+}
+
+inline bool is_name_char(char ch) {
+    return isalpha((unsigned char)ch) || isdigit((unsigned char)ch) || ch == '_';
+}
+
+/* Read the Token at pos and move past it */
+inline Token Token_stream::read()
+{
+    STATS_TIME_IN(stats, Stat::lex);
+    if (!failure.empty()) return Token(bad);
+    while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r')) pos++;  // ignore whitespaces
+    if (pos == s.size()) return Token(print);  // end of the statement
+
+    char ch = s[pos];
+    switch (ch) {
+        case print: case quit:
+        case '(': case ')': case '+': case '-': case '*': case '/': case '%': case '^': case '!': case ',': {
+            pos++;
+            return Token(ch);
+        }
+        case '.':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': {
+            double val;
+            auto [end, ec] = from_chars(s.data() + pos, s.data() + s.size(), val);  // read the whole number
+            if (ec != errc()) return fail("Bad number");
+            pos = end - s.data();
+            return Token(number, val);
+        }
+    }
+    if (!isalpha((unsigned char)ch)) return fail("Bad token");
+
+    size_t start = pos;
+    while (pos < s.size() && is_name_char(s[pos])) pos++;
+    string_view v_name = s.substr(start, pos - start);
+    size_t after = pos;
+    while (after < s.size() && (s[after] == ' ' || s[after] == '\t')) after++;
+    int slot = names ? names->intern(v_name) : table.find(v_name);
+    int index;
+    double log_base;
+    Kind kind = slot >= 0 ? table.kinds[slot] : Symbol_table::classify(v_name, index, log_base);
+    bool builtin = kind == Kind::builtin || kind == Kind::logarithm;
+
+    if (after < s.size() && s[after] == '=') {  // if define a variable
+        if (builtin) return fail("\"" + string(v_name) + "\" is a built-in name.");
+        pos = after + 1;
+        if (s.find_first_not_of(" \t\r", pos) == string_view::npos) return fail("Wrong way to define variables!");  // the definition needs a right-hand side
+        return Token(define, v_name, slot);
+    }
+    Token t(builtin ? special : variable, v_name, slot);
+    if (kind == Kind::logarithm) t.value = slot >= 0 ? table.values[slot] : log_base;
+    return t;
+}
+
+inline Token Token_stream::get_Token() {
+    if (has_next) {
+        has_next = false;
+        return next;
+    }
+    return read();
+}
+
+/* Tokens after the next one are read again when they are used, reading is cheap and changes nothing */
+inline Token Token_stream::peek(size_t k) {
+    if (!has_next) {
+        next = read();
+        has_next = true;
+    }
+    if (k == 0) return next;
+    size_t saved = pos;
+    Token t;
+    for (size_t i = 0; i < k; i++) t = read();
+    pos = saved;
+    return t;
+}
+
+//------------------------------------------------------------------------------
+
+// This section defines the compiled form of a statement
+
+/* Instructions of the stack machine run by run() */
+enum class Op : unsigned char
+{
+    push,   // push consts[arg]
+    load,   // push the number in slot arg
+    neg,    // unary minus
+    add, sub, mul, div, rem, pow,  // pop two, push one
+    fact,   // factorial of the top of the stack
+    powi,   // top of the stack to the integer power arg
+    call1,  // builtins[arg].fn1 on the top of the stack
+    call2,  // builtins[arg].fn2 on the top two
+    load_array,  // push the array in slot arg
+    linspace,    // pop first, last and count, push the evenly spaced array
+    rand_array,  // pop lb, ub and count, push count random numbers
+    save,   // copy the top of the stack to temporary arg
+    temp,   // push temporary arg
+    index,  // push the index of the reduction whose body this is, or of the one arg reductions out
+    reduce, // pop first and last, push reductions[arg] over the index from first to last
+    grad,   // push the derivatives of gradients[arg], a number or an array of one per variable
+};
+
+/* How many values an instruction adds to the stack */
+constexpr int stack_effect(Op op) {
+    switch (op) {
+        case Op::push: case Op::load: case Op::load_array: case Op::temp: case Op::index: case Op::grad: return 1;
+        case Op::add: case Op::sub: case Op::mul: case Op::div: case Op::rem: case Op::pow: case Op::call2: case Op::reduce: return -1;
+        case Op::linspace: case Op::rand_array: return -2;
+        default: return 0;  // unary operations keep the depth
+    }
+}
+
+struct Instr
+{
+    Op op;
+    int arg;
+};
+
+struct Reduction;
+struct Gradient;
+
+/* A compiled statement */
+struct Program
+{
+    vector<Instr> code;
+    vector<double> consts;
+    bool is_array {false};     // the result is an array, use run_array()
+    int target {-1};           // slot assigned by a definition, -1 for a plain expression
+    int depth {0};             // stack slots needed by run()
+    int temps {0};             // temporaries used by Op::save and Op::temp
+    int removed {0};           // expression nodes optimize() took out
+    vector<Reduction> reductions;  // used by Op::reduce
+    vector<Gradient> gradients;    // used by Op::grad
+};
+
+/* sum(i, first, last, body) and the like, body reads i with Op::index */
+struct Reduction
+{
+    int builtin;  // sum_builtin, prod_builtin, min_builtin or max
+    int depth;    // reductions around this one, whose indexes the body reads with Op::index 1, 2, ...
+    bool outer;   // the body reads one of them, so it runs again for every index around it
+    bool random;  // the body draws random numbers, so it runs on one thread in index order
+    Program body;
+};
+
+/* grad(body, x, y): the partial derivatives of body by the variables in wrt */
+struct Gradient
+{
+    Program body;
+    vector<int> wrt;  // slots of the variables
+};
+
+/* Call f(ins) for every instruction that loads a variable, in reduction and gradient bodies too */
+template<class F>
+void for_each_load(const Program &p, F f) {
+    for (const Instr &ins : p.code) {
+        if (ins.op == Op::load || ins.op == Op::load_array) f(ins);
+    }
+    for (const Reduction &r : p.reductions) for_each_load(r.body, f);
+    for (const Gradient &g : p.gradients) for_each_load(g.body, f);
+}
+
+/* Does the instruction draw random numbers, or reseed them */
+inline bool is_random(const Instr &ins) {
+    return ins.op == Op::rand_array || ((ins.op == Op::call1 || ins.op == Op::call2) && (ins.arg == rand_builtin || ins.arg == seed_builtin));
+}
+
+/* Does p draw random numbers, in its reductions too */
+inline bool draws_random(const Program &p) {
+    return any_of(p.code.begin(), p.code.end(), is_random) || any_of(p.reductions.begin(), p.reductions.end(), [](const Reduction &r) { return r.random; });
+}
+
+/* Does body read the index of a reduction level or more reductions around it */
+inline bool reads_outer_index(const Program &body, int level) {
+    for (const Instr &ins : body.code) {
+        if (ins.op == Op::index && ins.arg >= level) return true;
+    }
+    for (const Reduction &r : body.reductions) {
+        if (reads_outer_index(r.body, level + 1)) return true;
+    }
+    return false;
+}
+
+inline double reduce(const Reduction &r, double first, double last, const double *values, const double *outer = nullptr);
+inline const double *gradient(const Gradient &g, const double *values);
+
+//------------------------------------------------------------------------------
+
+// This section defines specific functions to turn Tokens into a Program
+
+/* Recursive descent over one statement, emitting code instead of calculating. Every
+   function returns false after an error, which is kept for the caller instead of thrown. */
+class Compiler
+{
+    private:
+        Token_stream ts;
+        Program *prog;  // where code goes, a reduction body while it is compiled
+        int sp {0};  // stack depth after the code emitted so far
+        const Symbol_table &symbols;
+        vector<string_view> bounds;  // index names of the reductions being compiled, innermost last
+        size_t first_bound {0};      // bounds before this belong to reductions around a grad body
+        bool defining {false};  // the statement is a definition, even of a name that has no slot
+        string failure;
+        Stats_batch stats;
+
+        bool fail(string message);
+        bool get(Token &t);
+        void emit(Op op, int arg = 0);
+        void push(double val);
+        bool load(const Token &t);
+        bool arguments(int &n);
+        bool expect(char key, const string &message);
+        bool reduction(int builtin);
+        bool gradient();
+        bool switch_operation(const Token &t);
+        bool primary();
+        bool power();
+        bool term();
+        bool expression();
+    public:
+        Compiler(string_view s, Program &p, const Symbol_table &t, Symbol_table *names): ts(s, t, names), prog(&p), symbols(t) {}
+        bool statement();
+        bool definition() const { return defining; }
+        const string &error() const { return failure; }
+};
+
+inline bool Compiler::fail(string message) {
+    if (failure.empty()) failure = move(message);
+    return false;
+}
+
+/* Next Token, false if it could not be read */
+inline bool Compiler::get(Token &t) {
+    t = ts.get_Token();
+    return t.key != bad || fail(ts.error());
+}
+
+inline void Compiler::emit(Op op, int arg) {
+    prog->code.push_back({op, arg});
+    sp += stack_effect(op);
+    prog->depth = max(prog->depth, sp);
+}
+
+inline void Compiler::push(double val) {
+    prog->consts.push_back(val);
+    emit(Op::push, int(prog->consts.size()) - 1);
+}
+
+/* Push a variable, it must be defined by now. The index of a reduction hides a variable of the same name. */
+inline bool Compiler::load(const Token &t) {
+    for (size_t i = bounds.size(); i-- > 0; ) {
+        if (t.name != bounds[i]) continue;
+        if (i < first_bound) return fail("grad cannot use the index \"" + string(t.name) + "\" of a reduction around it");
+        emit(Op::index, int(bounds.size() - 1 - i));
+        return true;
+    }
+    switch (t.slot >= 0 ? symbols.kinds[t.slot] : Kind::undefined) {
+        case Kind::number: emit(Op::load, t.slot); return true;
+        case Kind::array: {
+            emit(Op::load_array, t.slot);
+            prog->is_array = true;
+            return true;
+        }
+        default: return fail("No such variable \"" + string(t.name) + "\"");
+    }
+}
+
+/* Arguments of a special operation: (a) or (a, b), or a single primary as in sqrt 4 */
+inline bool Compiler::arguments(int &n) {
+    n = 1;
+    if (ts.peek().key != '(') return primary();
+    Token t;
+    get(t);
+    for (n = 0; ; ) {
+        if (!expression()) return false;
+        n++;
+        if (!get(t)) return false;
+        if (t.key == ')') return true;
+        if (t.key != ',') return fail("')' expected");
+    }
+}
+
+inline bool Compiler::expect(char key, const string &message) {
+    Token t;
+    if (!get(t)) return false;
+    return t.key == key || fail(message);
+}
+
+/* sum(i, first, last, body): the body goes into a Program of its own, where i is Op::index and
+   the indexes of the reductions around it are Op::index 1, 2, ... */
+inline bool Compiler::reduction(int builtin) {
+    string usage = string(builtins[builtin].name) + " takes (index, first, last, expression)";
+    Token t;
+    if (!expect('(', usage) || !get(t)) return false;
+    if (t.key != variable) return fail(usage + ", the index must be a name");
+    string_view name = t.name;
+    if (!expect(',', usage) || !expression() || !expect(',', usage) || !expression() || !expect(',', usage)) return false;
+
+    Reduction r {builtin, int(bounds.size()), false, false, {}};
+    Program *outer = prog;
+    int outer_sp = sp;
+    prog = &r.body;
+    bounds.push_back(name);
+    sp = 0;
+    bool compiled = expression();
+    prog = outer;
+    bounds.pop_back();
+    sp = outer_sp;
+    if (!compiled || !expect(')', usage)) return false;
+    if (r.body.is_array) return fail(string(builtins[builtin].name) + " needs a number for every index, not an array");
+    r.outer = reads_outer_index(r.body, 1);
+    r.random = draws_random(r.body);
+    prog->reductions.push_back(move(r));
+    emit(Op::reduce, int(prog->reductions.size()) - 1);
+    return true;
+}
+
+/* grad(body, x, y): body goes into a Program of its own, the variables must be numbers */
+inline bool Compiler::gradient() {
+    const string usage = "grad takes (expression, variable, ...)";
+    if (!expect('(', usage)) return false;
+    Gradient g;
+    Program *outer = prog;
+    size_t outer_first = first_bound;
+    int outer_sp = sp;
+    prog = &g.body;
+    first_bound = bounds.size();  // the index of a reduction around it is not a variable here
+    sp = 0;
+    bool compiled = expression();
+    prog = outer;
+    first_bound = outer_first;
+    sp = outer_sp;
+    if (!compiled) return false;
+    if (g.body.is_array) return fail("grad needs a number expression, not an array");
+
+    Token t;
+    if (!get(t)) return false;
+    while (t.key == ',') {
+        if (!get(t)) return false;
+        if (t.key != variable) return fail(usage + ", the variables must be names");
+        Kind kind = t.slot >= 0 ? symbols.kinds[t.slot] : Kind::undefined;
+        if (kind == Kind::array) return fail("grad needs number variables, \"" + string(t.name) + "\" is an array");
+        if (kind != Kind::number) return fail("No such variable \"" + string(t.name) + "\"");
+        g.wrt.push_back(t.slot);
+        if (!get(t)) return false;
+    }
+    if (t.key != ')') return fail(usage);
+    if (g.wrt.empty()) return fail(usage + ", at least 1 variable");
+    if (g.wrt.size() > 1) prog->is_array = true;
+    prog->gradients.push_back(move(g));
+    emit(Op::grad, int(prog->gradients.size()) - 1);
+    return true;
+}
+
+/* Switch special operations */
+inline bool Compiler::switch_operation(const Token &t) {
+    int n;
+    if (t.slot < 0 || symbols.kinds[t.slot] == Kind::logarithm) {  // logN(x) = log(x) / log(N)
+        STATS_BUILTIN(log_builtin);
+        if (!arguments(n)) return false;
+        if (n != 1) return fail("\"" + string(t.name) + "\" takes 1 argument");
+        emit(Op::call1, log_builtin);
+        push(t.value);
+        emit(Op::div);
+        return true;
+    }
+
+    int index = symbols.builtin[t.slot];
+    const Builtin &b = builtins[index];
+    STATS_BUILTIN(index);
+    switch (b.type) {
+        case Builtin_type::constant: push(b.value); return true;
+        case Builtin_type::unavailable: return fail("Cannot find this special operation");
+        case Builtin_type::reduction: return reduction(index);
+        case Builtin_type::gradient: return gradient();
+        case Builtin_type::linspace: {  // linspace(first, last, count)
+            if (!arguments(n)) return false;
+            if (n != 3) return fail("linspace takes 3 arguments");
+            emit(Op::linspace);
+            prog->is_array = true;
+            return true;
+        }
+        case Builtin_type::function: {
+            if (!arguments(n)) return false;
+            if (n == 1 && b.fn1) emit(Op::call1, index);
+            else if (n == 2 && b.fn2) emit(Op::call2, index);
+            else if (n == 3 && index == rand_builtin) {  // rand(lb, ub, n) fills an array
+                emit(Op::rand_array);
+                prog->is_array = true;
+            }
+            else return fail("Wrong number of arguments for \"" + string(t.name) + "\"");
+            return true;
+        }
+    }
+    return true;
+}
+
+/* Deal with numbers, variables, () and unary signs */
+inline bool Compiler::primary() {
+    STATS_TIME_IN(stats, Stat::primary);
+    Token t;
+    if (!get(t)) return false;
+    switch (t.key) {
+        case '(': {  // what's after '(' must be a number
+            if (!expression() || !get(t)) return false;
+            return t.key == ')' || fail("')' expected");
+        }
+        case number: {
+            push(t.value);
+            return true;
+        }
+        case variable: {
+            return load(t);
+        }
+        case '+': case '-': {  // unary plus and minus
+            char next = ts.peek().key;
+            if (next == '+' || next == '-') return fail("more than 1 consecutive '+' or '-' makes no sense");
+            if (!primary()) return false;
+            if (t.key == '-') emit(Op::neg);
+            return true;
+        }
+        case special: {
+            return switch_operation(t);
+        }
+        default: {  // inputs must begin with a primary
+            return fail("primary expected");
+        }
+    }
+}
+
+/* deal with ^ and !, which apply to the primary right before them */
+inline bool Compiler::power() {
+    if (!primary()) return false;
+    Token t;
+    while (true) {
+        switch (ts.peek().key) {
+            case '^': {
+                get(t);
+                if (!primary()) return false;  // exponential
+                emit(Op::pow);
+                break;
+            }
+            case '!': {
+                get(t);
+                emit(Op::fact);
+                break;
+            }
+            default: return true;
+        }
+    }
+}
+
+/* deal with *, / and % */
+inline bool Compiler::term() {
+    STATS_TIME_IN(stats, Stat::term);
+    if (!power()) return false;
+    Token t;
+    while (true) {
+        switch (ts.peek().key) {
+            case '*': get(t); if (!power()) return false; emit(Op::mul); break;
+            case '/': get(t); if (!power()) return false; emit(Op::div); break;
+            case '%': get(t); if (!power()) return false; emit(Op::rem); break;
+            default: return true;  // do term first, then do expression
+        }
+    }
+}
+
+/* deal with + and - */
+inline bool Compiler::expression() {
+    STATS_TIME_IN(stats, Stat::expression);
+    if (!term()) return false;
+    Token t;
+    while (true) {
+        switch (ts.peek().key) {
+            case '+': get(t); if (!term()) return false; emit(Op::add); break;  // always do term before expression
+            case '-': get(t); if (!term()) return false; emit(Op::sub); break;
+            default: return true;
+        }
+    }
+}
+
+/* Deal with variables */
+inline bool Compiler::statement() {
+    STATS_TIME_IN(stats, Stat::statement);
+    Token t = ts.peek();
+    if (t.key == define) {  // if define a new variable
+        get(t);
+        prog->target = t.slot;
+        defining = true;
+    }
+    if (!expression() || !get(t)) return false;
+    return t.key == print || fail("Bad token");  // one statement per line
+}
+
+//------------------------------------------------------------------------------
+
+// This section optimizes compiled statements
+
+inline double evaluate(const Program &p, const double *values);
+
+/* Values an instruction takes off the stack */
+constexpr int arity(Op op) {
+    switch (op) {
+        case Op::push: case Op::load: case Op::load_array: case Op::temp: case Op::index: case Op::grad: return 0;
+        case Op::linspace: case Op::rand_array: return 3;
+        case Op::neg: case Op::fact: case Op::call1: case Op::powi: case Op::save: return 1;
+        default: return 2;
+    }
+}
+
+/* Can an operation whose operands are all constants be replaced by its value */
+constexpr bool foldable(Op op) {
+    return op != Op::linspace && op != Op::rand_array && op != Op::push && op != Op::load && op != Op::load_array && op != Op::index && op != Op::reduce && op != Op::grad;
+}
+
+/* One value computed by a statement, children are positions in the node list */
+struct Node
+{
+    Instr ins;  // arg is 0 for Op::push, so equal constants are equal nodes
+    int child[3] {-1, -1, -1};
+    bool pure {true};  // no random numbers, so equal nodes have equal values
+    double value {0};  // for Op::push
+};
+
+/* Rebuilds a Program as a graph of Nodes, simplifies it and writes the code again. Each thread
+   keeps one, so the buffers are allocated once and not for every statement. */
+class Optimizer
+{
+    private:
+        vector<Node> nodes;
+        vector<int> table;  // pure nodes by contents for common subexpressions, open addressing with -1 for empty
+        vector<int> uses, temp, st;
+        vector<char> constants;  // for worth_running(), is each value on the stack a constant
+        vector<Instr> leaves;   // for worth_running(), the loads seen so far
+        Program out, scratch;   // the code written, and the operation fold() evaluates
+        int sp {0};
+
+        bool worth_running(const Program &p);
+        static size_t hash(const Node &n);
+        static bool same(const Node &a, const Node &b);
+        int add(Node n);
+        int fold(const Node &n);
+        void count_uses(int i);
+        void emit(Op op, int arg = 0);
+        void write(int i);
+    public:
+        void run(Program &p);
+};
+
+/* Could run() change p at all: it needs an operation on constants, a constant power, or a leaf
+   such as x that is loaded twice, since every common subexpression has one. Much cheaper than
+   run(), and most statements in a batch file are caught here. */
+inline bool Optimizer::worth_running(const Program &p) {
+    constants.clear();
+    leaves.clear();
+    for (const Instr &ins : p.code) {
+        if (ins.op == Op::save || ins.op == Op::temp) return false;  // already optimized
+        int n = arity(ins.op);
+        bool all = n > 0;
+        for (int k = 1; k <= n; k++) all = all && constants[constants.size() - k];
+        if (all && foldable(ins.op) && !is_random(ins)) return true;
+        if (ins.op == Op::pow && constants.back()) return true;
+        constants.resize(constants.size() - n);
+        constants.push_back(ins.op == Op::push);
+
+        if (ins.op == Op::load || ins.op == Op::load_array || ins.op == Op::index || ins.op == Op::linspace) {
+            Instr leaf {ins.op, ins.op == Op::linspace ? 0 : ins.arg};
+            if (leaves.size() == 64) return true;  // not worth the search
+            for (const Instr &seen : leaves) {
+                if (seen.op == leaf.op && seen.arg == leaf.arg) return true;
+            }
+            leaves.push_back(leaf);
+        }
+    }
+    return false;
+}
+
+inline size_t Optimizer::hash(const Node &n) {
+    uint64_t h;  // the bits, so that 0 and -0 differ and nan can be found
+    memcpy(&h, &n.value, sizeof(h));
+    h ^= h >> 32;  // constants such as 2 and 3 differ only in their high bits
+    for (int x : {int(n.ins.op), n.ins.arg, n.child[0], n.child[1], n.child[2]}) h = (h ^ uint32_t(x)) * 0x9e3779b97f4a7c15;
+    return h >> 32;  // the bits that depend on all of the above
+}
+
+inline bool Optimizer::same(const Node &a, const Node &b) {
+    return a.ins.op == b.ins.op && a.ins.arg == b.ins.arg && a.child[0] == b.child[0] && a.child[1] == b.child[1] && a.child[2] == b.child[2] && memcmp(&a.value, &b.value, sizeof(a.value)) == 0;
+}
+
+/* Add a node after folding and strength reduction, or find an equal one */
+inline int Optimizer::add(Node n) {
+    Op op = n.ins.op;
+    bool constant = foldable(op);
+    for (int c : n.child) {
+        if (c < 0) break;
+        n.pure = n.pure && nodes[c].pure;
+        constant = constant && nodes[c].ins.op == Op::push;
+    }
+    if (constant && n.pure) return fold(n);
+
+    if (op == Op::pow && nodes[n.child[1]].ins.op == Op::push) {  // x^k for small integers k is a few multiplications
+        double k = nodes[n.child[1]].value;
+        if (k == floor(k) && abs(k) <= 16) {
+            if (k == 1) return n.child[0];
+            n = {{Op::powi, int(k)}, {n.child[0], -1, -1}, n.pure, 0};
+        }
+    }
+
+    if (n.pure) {
+        size_t mask = table.size() - 1;
+        size_t i = hash(n) & mask;
+        for (; table[i] >= 0; i = (i + 1) & mask) {
+            if (same(nodes[table[i]], n)) return table[i];
+        }
+        table[i] = int(nodes.size());
+    }
+    nodes.push_back(n);
+    return int(nodes.size()) - 1;
+}
+
+/* Replace an operation on constants by its value, unless it is an error such as 1/0 which is left for run time */
+inline int Optimizer::fold(const Node &n) {
+    scratch.code.clear();
+    scratch.consts.clear();
+    for (int c : n.child) {
+        if (c < 0) break;
+        scratch.consts.push_back(nodes[c].value);
+        scratch.code.push_back({Op::push, int(scratch.consts.size()) - 1});
+    }
+    scratch.code.push_back(n.ins);
+    scratch.depth = int(scratch.consts.size());
+    double value;
+    try {
+        value = evaluate(scratch, nullptr);
+    }
+    catch (exception &) {
+        nodes.push_back(n);
+        return int(nodes.size()) - 1;
+    }
+    return add({{Op::push, 0}, {-1, -1, -1}, true, value});
+}
+
+inline void Optimizer::count_uses(int i) {
+    if (uses[i]++ > 0) return;
+    for (int c : nodes[i].child) {
+        if (c >= 0) count_uses(c);
+    }
+}
+
+inline void Optimizer::emit(Op op, int arg) {
+    out.code.push_back({op, arg});
+    sp += stack_effect(op);
+    out.depth = max(out.depth, sp);
+}
+
+/* Code for node i, a node used more than once is kept in a temporary after its first use */
+inline void Optimizer::write(int i) {
+    const Node &n = nodes[i];
+    if (temp[i] >= 0) {
+        emit(Op::temp, temp[i]);
+        return;
+    }
+    for (int c : n.child) {
+        if (c >= 0) write(c);
+    }
+    if (n.ins.op == Op::push) {
+        out.consts.push_back(n.value);
+        emit(Op::push, int(out.consts.size()) - 1);
+    }
+    else emit(n.ins.op, n.ins.arg);
+    bool leaf = n.ins.op == Op::push || n.ins.op == Op::load || n.ins.op == Op::load_array || n.ins.op == Op::index;
+    if (uses[i] > 1 && !leaf) {
+        temp[i] = out.temps++;
+        emit(Op::save, temp[i]);
+    }
+}
+
+/* Optimize p in place, its code and constants keep their buffers when the new ones fit */
+inline void Optimizer::run(Program &p) {
+    if (!worth_running(p)) return;
+    nodes.clear();
+    st.clear();
+    size_t size = 16;
+    while (size < 4 * p.code.size()) size *= 2;  // a node per instruction and per folded value, at most half full
+    table.assign(size, -1);
+    for (const Instr &ins : p.code) {
+        Node n;
+        n.ins = ins;
+        if (ins.op == Op::push) {
+            n.value = p.consts[ins.arg];
+            n.ins.arg = 0;
+        }
+        int k = arity(ins.op);
+        for (int c = 0; c < k; c++) n.child[c] = st[st.size() - k + c];
+        st.resize(st.size() - k);
+        n.pure = !is_random(ins);
+        st.push_back(add(n));
+    }
+
+    uses.assign(nodes.size(), 0);
+    temp.assign(nodes.size(), -1);
+    count_uses(st.back());
+    out.code.clear();
+    out.consts.clear();
+    out.depth = out.temps = sp = 0;
+    write(st.back());
+
+    int kept = 0;
+    for (const Instr &ins : out.code) kept += ins.op != Op::save && ins.op != Op::temp;
+    p.removed = int(p.code.size()) - kept;
+    p.code.assign(out.code.begin(), out.code.end());
+    p.consts.assign(out.consts.begin(), out.consts.end());
+    p.depth = out.depth;
+    p.temps = out.temps;
+}
+
+/* Fold constants (2 * pi / 180), compute repeated subexpressions once (sin(x) * sin(x)) and
+   turn small integer powers into multiplications. Every program gives the same results as before,
+   up to rounding in the powers. */
+inline void optimize(Program &p) {
+    thread_local Optimizer optimizer;
+    optimizer.run(p);
+    for (Reduction &r : p.reductions) {
+        optimize(r.body);
+        p.removed += r.body.removed;
+    }
+    for (Gradient &g : p.gradients) {
+        optimize(g.body);
+        p.removed += g.body.removed;
+    }
+}
+
+/* Does every load in p still match the kind of its variable */
+inline bool loads_match(const Program &p, const Symbol_table &symbols) {
+    bool match = true;
+    for_each_load(p, [&](const Instr &ins) { match = match && (ins.op == Op::load_array) == (symbols.kinds[ins.arg] == Kind::array); });
+    return match;
+}
+
+/* Compile one statement, variables must already be defined. Errors come back in the result. */
+inline Expected<Program> try_compile(string_view s, Session &session) {
+    Program p;
+    Compiler c(s, p, session.symbols, &session.symbols);
+    if (!c.statement()) return Unexpected {c.error()};
+    if (session.optimize && !session.exact) optimize(p);  // folding would round exact integers
+    try {
+        session.update(p);  // so p sees the latest value of every variable it loads
+    }
+    catch (exception &e) {
+        return Unexpected {e.what()};
+    }
+    if (!loads_match(p, session.symbols)) return try_compile(s, session);  // a variable has turned into an array or back
+    return p;
+}
+
+/* Compile without adding names to the session, so threads can share it */
+inline Expected<Program> try_compile(string_view s, const Session &session) {
+    Program p;
+    Compiler c(s, p, session.symbols, nullptr);
+    if (!c.statement()) return Unexpected {c.error()};
+    if (c.definition()) return Unexpected {"Definitions cannot be compiled here"};
+    int stale = -1;  // nobody may recompute a stale variable in a shared session
+    for_each_load(p, [&](const Instr &ins) { if (stale < 0 && session.is_stale(ins.arg)) stale = ins.arg; });
+    if (stale >= 0) {
+        const string &why = session.failure(stale);
+        return Unexpected {why.empty() ? "\"" + session.symbols.names[stale] + "\" is out of date" : why};
+    }
+    if (session.optimize && !session.exact) optimize(p);
+    return p;
+}
+
+/* try_compile() that throws its errors */
+inline Program compile(string_view s, Session &session) {
+    Expected<Program> p = try_compile(s, session);
+    if (!p) error(p.error());
+    return move(*p);
+}
+
+inline Program compile(string_view s, const Session &session) {
+    Expected<Program> p = try_compile(s, session);
+    if (!p) error(p.error());
+    return move(*p);
+}
+
+//------------------------------------------------------------------------------
+
+// This section runs compiled statements
+
+/* Evaluate a Program with the given values of its variables, without assigning */
+inline double evaluate(const Program &p, const double *values) {
+    if (p.is_array) error("Array result, use evaluate_array()");
+    STATS_TIME(Stat::evaluate);
+    thread_local vector<double> stack, temps;
+    if (stack.size() < size_t(p.depth)) stack.resize(p.depth);
+    if (temps.size() < size_t(p.temps)) temps.resize(p.temps);
+    double *st = stack.data();
+    int sp = 0;  // number of values on the stack
+
+    for (const Instr &ins : p.code) {
+        switch (ins.op) {
+            case Op::push: st[sp++] = p.consts[ins.arg]; break;
+            case Op::load: st[sp++] = values[ins.arg]; break;
+            case Op::neg: st[sp - 1] = -st[sp - 1]; break;
+            case Op::add: sp--; st[sp - 1] += st[sp]; break;
+            case Op::sub: sp--; st[sp - 1] -= st[sp]; break;
+            case Op::mul: sp--; st[sp - 1] *= st[sp]; break;
+            case Op::div: {
+                sp--;
+                if (st[sp] == 0) error("Inf");
+                st[sp - 1] /= st[sp];
+                break;
+            }
+            case Op::rem: {
+                sp--;
+                double d = st[sp], left = st[sp - 1];
+                if (d == 0) error("Inf");
+                st[sp - 1] = left - d * int(left / d);
+                break;
+            }
+            case Op::pow: sp--; st[sp - 1] = pow(st[sp - 1], st[sp]); break;
+            case Op::fact: st[sp - 1] = factorial(st[sp - 1]); break;
+            case Op::powi: st[sp - 1] = power_int(st[sp - 1], ins.arg); break;
+            case Op::save: temps[ins.arg] = st[sp - 1]; break;
+            case Op::temp: st[sp++] = temps[ins.arg]; break;
+            case Op::call1: st[sp - 1] = builtins[ins.arg].fn1(st[sp - 1]); break;
+            case Op::call2: sp--; st[sp - 1] = builtins[ins.arg].fn2(st[sp - 1], st[sp]); break;
+            case Op::reduce: sp--; st[sp - 1] = reduce(p.reductions[ins.arg], st[sp - 1], st[sp], values); break;
+            case Op::grad: st[sp++] = gradient(p.gradients[ins.arg], values)[0]; break;  // one variable, or the Program is an array
+            case Op::index: error("Bad instruction");  // reduction bodies run in run_block()
+            case Op::load_array: case Op::linspace: case Op::rand_array: error("Array result, use evaluate_array()");
+        }
+    }
+
+    return st[0];
+}
+
+/* Evaluate a Program with the current values of its variables */
+inline double evaluate(const Program &p, const Session &session) {
+    return evaluate(p, session.symbols.values.data());
+}
+
+/* Evaluate a Program and carry out its definition, if it has one */
+inline double run(const Program &p, Session &session) {
+    double result = evaluate(p, session);
+    if (p.target >= 0) {
+        session.define(p);
+        session.symbols.set(p.target, result);
+        session.changed(p.target);
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+
+// This section runs integer statements exactly, for the exact mode
+
+const double exact_digits = 1e6;  // longest exact result, 10^6 digits is about 200000!
+
+/* Can p be run exactly: integers combined only by +, -, *, ^ and ! */
+inline bool is_integer_program(const Program &p, const Session &session) {
+    if (p.is_array) return false;
+    for (const Instr &ins : p.code) {
+        switch (ins.op) {
+            case Op::push: case Op::load: {
+                double x = ins.op == Op::push ? p.consts[ins.arg] : session.symbols.values[ins.arg];
+                if (x != floor(x) || isinf(x)) return false;
+                break;
+            }
+            case Op::neg: case Op::add: case Op::sub: case Op::mul: case Op::pow: case Op::fact: break;
+            case Op::save: case Op::temp: break;
+            case Op::powi: if (ins.arg < 0) return false; break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+/* Evaluate a Program for which is_integer_program() holds, with arbitrary precision */
+inline Big_int evaluate_exact(const Program &p, const Session &session) {
+    vector<Big_int> st, temps(p.temps);
+    for (const Instr &ins : p.code) {
+        switch (ins.op) {
+            case Op::push: st.push_back(Big_int::from_double(p.consts[ins.arg])); break;
+            case Op::load: st.push_back(Big_int::from_double(session.symbols.values[ins.arg])); break;
+            case Op::neg: st.back() = -st.back(); break;
+            case Op::powi: st.back() = st.back().pow(ins.arg); break;
+            case Op::save: temps[ins.arg] = st.back(); break;
+            case Op::temp: st.push_back(temps[ins.arg]); break;
+            case Op::fact: {
+                long long n;
+                if (!st.back().to_long(n) || n < 0) error("Inf");
+                if (lgamma(double(n) + 1) / log(10.0) > exact_digits) error("Too many digits for the exact mode");
+                st.back() = Big_int::factorial(n);
+                break;
+            }
+            default: {
+                Big_int b = move(st.back());
+                st.pop_back();
+                Big_int &a = st.back();
+                if (ins.op == Op::add) a = a + b;
+                else if (ins.op == Op::sub) a = a - b;
+                else if (ins.op == Op::mul) a = a * b;
+                else {
+                    long long k;
+                    if (!b.to_long(k) || k < 0) error("The exact mode needs exponents from 0 up");
+                    double base = abs(a.to_double());
+                    if (base > 1 && k * log10(base) > exact_digits) error("Too many digits for the exact mode");
+                    a = a.pow(k);
+                }
+                break;
+            }
+        }
+    }
+    return st.back();
+}
+
+//------------------------------------------------------------------------------
+
+// This section runs compiled statements over arrays, one block of elements at a time
+
+const int block_size = 1024;  // elements per stack slot, a few slots stay in L1 cache
+
+/* Sets the array length n, or checks that another array agrees with it */
+inline void array_length(size_t &n, size_t len) {
+    if (n == size_t(-1)) n = len;
+    else if (n != len) error("Array sizes do not match");
+}
+
+/* Run p over elements [offset, offset + len) into regs, len 0 only finds the array length n.
+   Temporaries live after the p.depth stack slots, in regs and in st, and then the value of
+   every reduction that is the same for all elements, which the len 0 pass computes once.
+   For a reduction body, Op::index counts up from index + offset, and outer holds the
+   indexes of the reductions around it, innermost first. */
+inline Operand run_block(const Program &p, const double *values, const vector<double> *arrays, size_t offset, int len, size_t &n, vector<double> &regs, vector<Operand> &st, double index = 0, const double *outer = nullptr) {
+    int sp = 0;
+    for (const Instr &ins : p.code) {
+        double *out = regs.data() + size_t(sp) * block_size;  // where the slot being pushed or replaced lives
+        switch (ins.op) {
+            case Op::push: out[0] = p.consts[ins.arg]; st[sp++] = {out, true}; break;
+            case Op::load: out[0] = values[ins.arg]; st[sp++] = {out, true}; break;
+            case Op::index: {
+                if (ins.arg > 0) {  // a reduction around this one, its index is the same for the whole block
+                    out[0] = outer[ins.arg - 1];
+                    st[sp++] = {out, true};
+                    break;
+                }
+                vec_iota(index + double(offset), out, len);
+                st[sp++] = {out, false};
+                break;
+            }
+            case Op::grad: {
+                const Gradient &g = p.gradients[ins.arg];
+                bool scalar = g.wrt.size() == 1;
+                if (!scalar) array_length(n, g.wrt.size());
+                if (scalar || len > 0) {
+                    const double *d = gradient(g, values);
+                    copy(d + (scalar ? 0 : offset), d + (scalar ? 1 : offset + len), out);
+                }
+                st[sp++] = {out, scalar};
+                break;
+            }
+            case Op::load_array: {
+                const vector<double> &a = arrays[ins.arg];
+                array_length(n, a.size());
+                st[sp++] = {a.data() + offset, false};
+                break;
+            }
+            case Op::linspace: case Op::rand_array: {
+                sp -= 2;
+                out = regs.data() + size_t(sp - 1) * block_size;
+                Operand first = st[sp - 1], last = st[sp], count = st[sp + 1];
+                const char *name = ins.op == Op::linspace ? "linspace" : "rand";
+                if (!first.scalar || !last.scalar || !count.scalar) error(string(name) + " takes numbers, not arrays");
+                double c = *count.data;
+                if (c < 1 || c - floor(c) != 0) error(string(name) + " count must be a positive integer");
+                array_length(n, size_t(c));
+                double a = *first.data, b = *last.data;
+                if (ins.op == Op::rand_array) {
+                    rng.fill(out, len, a, b);
+                }
+                else {
+                    double step = c > 1 ? (b - a) / (c - 1) : 0;
+                    for (int i = 0; i < len; i++) out[i] = offset + i == size_t(c) - 1 ? b : a + (offset + i) * step;
+                }
+                st[sp - 1] = {out, false};
+                break;
+            }
+            case Op::temp: st[sp++] = st[p.depth + ins.arg]; break;
+            case Op::save: {
+                Operand a = st[sp - 1];
+                double *t = regs.data() + size_t(p.depth + ins.arg) * block_size;
+                copy(a.data, a.data + (a.scalar ? 1 : len), t);
+                st[p.depth + ins.arg] = {t, a.scalar};
+                break;
+            }
+            case Op::neg: {
+                out -= block_size;
+                Operand a = st[sp - 1];
+                if (a.scalar) out[0] = -*a.data;
+                else vec_neg(a.data, out, len);
+                st[sp - 1] = {out, a.scalar};
+                break;
+            }
+            case Op::powi: {
+                out -= block_size;
+                Operand a = st[sp - 1];
+                if (a.scalar) out[0] = power_int(*a.data, ins.arg);
+                else vec_powi(a.data, ins.arg, out, len);
+                st[sp - 1] = {out, a.scalar};
+                break;
+            }
+            case Op::fact: case Op::call1: {
+                out -= block_size;
+                Operand a = st[sp - 1];
+                int m = a.scalar ? 1 : len;
+                double (*fn)(double) = ins.op == Op::call1 ? builtins[ins.arg].fn1 : nullptr;
+                double (*const degree[])(double) = {sine_deg, cosine_deg, tangent_deg, cotangent_deg};
+                int which = int(find(begin(degree), end(degree), fn) - begin(degree));
+                if (fn == square_root) vec_sqrt(a.data, out, m);
+                else if (which < 4) {
+                    if (!vec_trig_deg(a.data, out, m, which)) error("Inf");
+                }
+                else {
+                    for (int i = 0; i < m; i++) {
+                        double x = a.data[i];
+                        out[i] = ins.op == Op::call1 ? builtins[ins.arg].fn1(x) : factorial(x);
+                    }
+                }
+                st[sp - 1] = {out, a.scalar};
+                break;
+            }
+            default: {  // operations of two operands
+                sp--;
+                out -= 2 * block_size;
+                Operand a = st[sp - 1], b = st[sp];
+                double av = *a.data, bv = *b.data;  // out may be the register a scalar lives in
+                if (a.scalar) a.data = &av;
+                if (b.scalar) b.data = &bv;
+                bool scalar = a.scalar && b.scalar;
+                int m = scalar ? 1 : len;
+                switch (ins.op) {
+                    case Op::add: vec_add(a, b, out, m); break;
+                    case Op::sub: vec_sub(a, b, out, m); break;
+                    case Op::mul: vec_mul(a, b, out, m); break;
+                    case Op::div: {
+                        if (vec_any_zero(b, m)) error("Inf");
+                        vec_div(a, b, out, m);
+                        break;
+                    }
+                    case Op::pow: {
+                        double k = bv;
+                        if (b.scalar && !a.scalar && k == floor(k) && abs(k) <= 16) vec_powi(a.data, long(k), out, m);
+                        else for (int i = 0; i < m; i++) out[i] = pow(a.data[a.scalar ? 0 : i], b.data[b.scalar ? 0 : i]);
+                        break;
+                    }
+                    case Op::rem: {
+                        if (vec_any_zero(b, m)) error("Inf");
+                        for (int i = 0; i < m; i++) {
+                            double left = a.data[a.scalar ? 0 : i], d = b.data[b.scalar ? 0 : i];
+                            out[i] = left - d * int(left / d);
+                        }
+                        break;
+                    }
+                    case Op::call2: {
+                        for (int i = 0; i < m; i++) out[i] = builtins[ins.arg].fn2(a.data[a.scalar ? 0 : i], b.data[b.scalar ? 0 : i]);
+                        break;
+                    }
+                    case Op::reduce: {
+                        const Reduction &r = p.reductions[ins.arg];
+                        if (scalar && !r.outer) {
+                            double &value = regs[size_t(p.depth + p.temps) * block_size + ins.arg];
+                            if (len == 0) value = reduce(r, av, bv, values);
+                            out[0] = value;
+                            break;
+                        }
+                        scalar = false;  // one reduction for every element, with its own range or index
+                        vector<double> around(r.depth);  // the index of this body, then the ones around it
+                        if (r.depth > 0) copy(outer, outer + r.depth - 1, around.begin() + 1);
+                        for (int i = 0; i < len; i++) {
+                            if (r.depth > 0) around[0] = index + double(offset + i);
+                            out[i] = reduce(r, a.data[a.scalar ? 0 : i], b.data[b.scalar ? 0 : i], values, around.data());
+                        }
+                        break;
+                    }
+                    default: error("Bad instruction");
+                }
+                st[sp - 1] = {out, scalar};
+                break;
+            }
+        }
+    }
+    return st[0];
+}
+
+/* Evaluate a Program element-wise over its array variables, also works for numbers */
+inline vector<double> evaluate_array(const Program &p, const Session &session) {
+    STATS_TIME(Stat::evaluate_array);
+    vector<double> regs(size_t(max(p.depth, 1) + p.temps) * block_size + p.reductions.size());
+    vector<Operand> st(max(p.depth, 1) + p.temps);
+    size_t n = size_t(-1);
+    const Symbol_table &symbols = session.symbols;
+    run_block(p, symbols.values.data(), symbols.arrays.data(), 0, 0, n, regs, st);  // only finds the length
+    if (n == size_t(-1)) n = 1;  // no arrays involved
+
+    vector<double> result(n);
+    for (size_t offset = 0; offset < n; offset += block_size) {
+        int len = int(min(n - offset, size_t(block_size)));
+        Operand r = run_block(p, symbols.values.data(), symbols.arrays.data(), offset, len, n, regs, st);
+        if (r.scalar) fill(result.begin() + offset, result.begin() + offset + len, *r.data);
+        else copy(r.data, r.data + len, result.begin() + offset);
+    }
+    return result;
+}
+
+/* Evaluate over arrays and carry out the definition, which moves the result so nothing is returned */
+inline vector<double> run_array(const Program &p, Session &session) {
+    vector<double> result = evaluate_array(p, session);
+    if (p.target >= 0) {
+        session.define(p);
+        session.symbols.set_array(p.target, move(result));
+        session.changed(p.target);
+        result.clear();
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+
+// This section runs reductions: sum, prod, min and max of a body over an index range
+
+/* Neumaier's compensated sum, the rounding error of every addition is carried in c */
+struct Compensated_sum
+{
+    double sum {0};
+    double c {0};
+
+    void add(double x) {
+        double t = sum + x;
+        c += abs(sum) >= abs(x) ? (sum - t) + x : (x - t) + sum;
+        sum = t;
+    }
+    double value() const { return sum + c; }
+};
+
+/* Sum of a[0, n) in halves, the rounding error grows with log n instead of n */
+inline double pairwise_sum(const double *a, int n) {
+    if (n <= 128) return vec_sum(a, n);
+    int half = n / 2;
+    return pairwise_sum(a, half) + pairwise_sum(a + half, n - half);
+}
+
+/* min and max keep a nan once they have seen one, as sum and prod do */
+inline void keep_extreme(int builtin, double &extreme, double x) {
+    if (x != x || (builtin == min_builtin ? x < extreme : x > extreme)) extreme = x;
+}
+
+const size_t reduction_chunk = 64 * block_size;  // indexes per task, fixed so the result does not depend on the thread count
+
+inline thread_local bool in_reduction = false;  // a nested reduction runs on the thread of the outer one
+
+/* Threads that help reduce(), one fewer than the cores because the calling thread works too.
+   Their tasks never wait for other tasks, so callers on any number of threads can share them. */
+inline Thread_pool &reduction_pool() {
+    static Thread_pool pool(max(thread::hardware_concurrency(), 2u) - 1);
+    return pool;
+}
+
+/* The body of r for indexes first + [begin, end), block by block; the product, least or greatest value is in sum */
+inline Compensated_sum reduce_chunk(const Reduction &r, double first, size_t begin, size_t end, const double *values, const double *outer) {
+    const Program &p = r.body;
+    vector<double> regs(size_t(max(p.depth, 1) + p.temps) * block_size + p.reductions.size());
+    vector<Operand> st(max(p.depth, 1) + p.temps);
+    size_t n = end;  // the body has no arrays, so this stays
+    run_block(p, values, nullptr, 0, 0, n, regs, st, first, outer);  // nested reductions that do not use the index, once
+
+    Compensated_sum acc;
+    if (r.builtin == prod_builtin) acc.sum = 1;
+    else if (r.builtin != sum_builtin) acc.sum = r.builtin == min_builtin ? HUGE_VAL : -HUGE_VAL;
+    for (size_t offset = begin; offset < end; offset += block_size) {
+        int len = int(min(end - offset, size_t(block_size)));
+        Operand x = run_block(p, values, nullptr, offset, len, n, regs, st, first, outer);
+        int m = x.scalar ? 1 : len;
+        if (r.builtin == sum_builtin) acc.add(x.scalar ? *x.data * len : pairwise_sum(x.data, len));
+        else if (r.builtin == prod_builtin) {
+            if (x.scalar) acc.sum *= power_int(*x.data, len);
+            else for (int i = 0; i < m; i++) acc.sum *= x.data[i];
+        }
+        else for (int i = 0; i < m; i++) keep_extreme(r.builtin, acc.sum, x.data[i]);
+    }
+    return acc;
+}
+
+/* The range is cut into fixed chunks that threads take in turn, and the chunk results are
+   combined in index order, so a sum is the same on any number of threads. A body that draws
+   random numbers runs on the calling thread only, in index order, so seed(n) repeats it.
+   The first error in index order is the one reported. */
+inline double reduce(const Reduction &r, double first, double last, const double *values, const double *outer) {
+    STATS_TIME(Stat::reduce);
+    string name = builtins[r.builtin].name;
+    if (!isfinite(first) || !isfinite(last)) error(name + " needs a finite range");
+    if (last - first >= 1e15) error(name + " over more than 10^15 indexes would never finish");
+    size_t n = last < first ? 0 : size_t(floor(last - first)) + 1;
+    if (n == 0) {
+        if (r.builtin == sum_builtin) return 0;
+        if (r.builtin == prod_builtin) return 1;
+        error(name + " of an empty range");
+    }
+
+    size_t chunks = (n + reduction_chunk - 1) / reduction_chunk;
+    vector<Compensated_sum> partial(chunks);
+    vector<exception_ptr> failed(chunks);
+    atomic<size_t> next {0}, stop {chunks};  // chunks after a failed one are skipped
+    auto work = [&] {
+        bool nested = in_reduction;
+        in_reduction = true;
+        for (size_t k; (k = next++) < chunks && k < stop; ) {
+            try {
+                partial[k] = reduce_chunk(r, first, k * reduction_chunk, min(n, (k + 1) * reduction_chunk), values, outer);
+            }
+            catch (...) {
+                failed[k] = current_exception();
+                for (size_t s = stop; k < s && !stop.compare_exchange_weak(s, k); ) {}
+            }
+        }
+        in_reduction = nested;
+    };
+    size_t threads = in_reduction || r.random ? 1 : min(size_t(max(thread::hardware_concurrency(), 1u)), chunks);
+    mutex m;
+    condition_variable cv;
+    size_t helping = threads - 1;
+    for (size_t t = 1; t < threads; t++) {
+        reduction_pool().submit([&] {
+            work();
+            lock_guard<mutex> lock(m);
+            if (--helping == 0) cv.notify_one();
+        });
+    }
+    work();
+    unique_lock<mutex> lock(m);
+    cv.wait(lock, [&] { return helping == 0; });  // work() refers to this frame until the last helper is done
+
+    for (const exception_ptr &e : failed) {
+        if (e) rethrow_exception(e);
+    }
+    Compensated_sum total = partial[0];
+    for (size_t k = 1; k < chunks; k++) {
+        if (r.builtin == sum_builtin) {
+            total.add(partial[k].sum);
+            total.add(partial[k].c);
+        }
+        else if (r.builtin == prod_builtin) total.sum *= partial[k].sum;
+        else keep_extreme(r.builtin, total.sum, partial[k].sum);
+    }
+    return total.value();
+}
+
+//------------------------------------------------------------------------------
+
+// This section differentiates compiled statements, for grad()
+
+/* Digamma function, the derivative of lgamma(x): shifted up to x >= 10 by psi(x) = psi(x + 1) - 1/x,
+   then the asymptotic series; reflected below 1/2 */
+inline double digamma(double x) {
+    if (x <= 0 && x == floor(x)) error("Inf");
+    if (x < 0.5) return digamma(1 - x) - M_PI / tan(M_PI * x);
+    double shift = 0;
+    for (; x < 10; x++) shift -= 1 / x;
+    double z = 1 / (x * x);
+    double series = z * (1.0 / 12 - z * (1.0 / 120 - z * (1.0 / 252 - z * (1.0 / 240 - z * (1.0 / 132 - z * (691.0 / 32760))))));
+    return shift + log(x) - 0.5 / x - series;
+}
+
+/* f'(x) of a builtin f of one argument, fx = f(x) */
+inline double derivative(int builtin, double x, double fx) {
+    const double rad = M_PI / 180;  // d/dx of x degrees in radians
+    double (*fn)(double) = builtins[builtin].fn1;
+    if (fn == square_root) {
+        if (fx == 0) error("Inf");
+        return 0.5 / fx;
+    }
+    if (fn == logarithm) return 1 / x;
+    if (fn == sine) return cosine(x);
+    if (fn == cosine) return -sine(x);
+    if (fn == tangent) return 1 + fx * fx;
+    if (fn == cotangent) return -(1 + fx * fx);
+    if (fn == sine_deg) return cosine_deg(x) * rad;
+    if (fn == cosine_deg) return -sine_deg(x) * rad;
+    if (fn == tangent_deg) return (1 + fx * fx) * rad;
+    if (fn == cotangent_deg) return -(1 + fx * fx) * rad;
+    if (fn == gamma_function) return fx * digamma(x);
+    if (fn == log_gamma) return digamma(x);
+    error("grad cannot differentiate " + string(builtins[builtin].name));
+}
+
+/* The partial derivatives of g.body by g.wrt, in one forward pass. Every stack entry is a value
+   followed by its k partials, a dual number when k is 1; the pointer is to the k partials and
+   stays valid until the next call on this thread. */
+inline const double *gradient(const Gradient &g, const double *values) {
+    const Program &p = g.body;
+    const int k = int(g.wrt.size()), w = k + 1;
+    thread_local vector<double> stack, temps;
+    stack.assign(size_t(max(p.depth, 1)) * w, 0);
+    if (temps.size() < size_t(p.temps) * w) temps.resize(size_t(p.temps) * w);
+    int sp = 0;
+
+    for (const Instr &ins : p.code) {
+        double *top = stack.data() + size_t(sp) * w;  // the entry being pushed
+        double *a = top - 2 * w, *b = top - w;         // operands of a binary operation
+        switch (ins.op) {
+            case Op::push: case Op::load: {
+                top[0] = ins.op == Op::push ? p.consts[ins.arg] : values[ins.arg];
+                for (int j = 0; j < k; j++) top[j + 1] = ins.op == Op::load && g.wrt[j] == ins.arg;
+                sp++;
+                break;
+            }
+            case Op::neg: for (int j = 0; j < w; j++) b[j] = -b[j]; break;
+            case Op::add: for (int j = 0; j < w; j++) a[j] += b[j]; sp--; break;
+            case Op::sub: for (int j = 0; j < w; j++) a[j] -= b[j]; sp--; break;
+            case Op::mul: {
+                for (int j = 1; j < w; j++) a[j] = a[j] * b[0] + a[0] * b[j];
+                a[0] *= b[0];
+                sp--;
+                break;
+            }
+            case Op::div: {
+                if (b[0] == 0) error("Inf");
+                a[0] /= b[0];
+                for (int j = 1; j < w; j++) a[j] = (a[j] - a[0] * b[j]) / b[0];
+                sp--;
+                break;
+            }
+            case Op::rem: {  // a - d * int(a / d), the truncation is a step with derivative 0
+                if (b[0] == 0) error("Inf");
+                double q = int(a[0] / b[0]);
+                for (int j = 0; j < w; j++) a[j] -= q * b[j];
+                sp--;
+                break;
+            }
+            case Op::pow: {
+                double x = a[0], y = b[0], v = pow(x, y);
+                bool constant_exponent = all_of(b + 1, b + w, [](double d) { return d == 0; });
+                double dx = constant_exponent && y == 0 ? 0 : y * pow(x, y - 1);  // d/dx x^y, also right at x = 0
+                for (int j = 1; j < w; j++) a[j] = dx * a[j] + (b[j] == 0 || v == 0 ? 0 : v * log(x) * b[j]);
+                a[0] = v;
+                sp--;
+                break;
+            }
+            case Op::powi: {
+                double dx = ins.arg == 0 ? 0 : ins.arg * power_int(b[0], ins.arg - 1);
+                for (int j = 1; j < w; j++) b[j] *= dx;
+                b[0] = power_int(b[0], ins.arg);
+                break;
+            }
+            case Op::fact: {  // x! = gamma(x + 1)
+                double v = factorial(b[0]), dx = v * digamma(b[0] + 1);
+                for (int j = 1; j < w; j++) b[j] *= dx;
+                b[0] = v;
+                break;
+            }
+            case Op::call1: {
+                if (ins.arg == rand_builtin || ins.arg == seed_builtin) error("grad cannot differentiate " + string(builtins[ins.arg].name));
+                double v = builtins[ins.arg].fn1(b[0]), dx = derivative(ins.arg, b[0], v);
+                for (int j = 1; j < w; j++) b[j] *= dx;
+                b[0] = v;
+                break;
+            }
+            case Op::save: copy(b, b + w, temps.data() + size_t(ins.arg) * w); break;
+            case Op::temp: {
+                const double *t = temps.data() + size_t(ins.arg) * w;
+                copy(t, t + w, top);
+                sp++;
+                break;
+            }
+            case Op::call2: error("grad cannot differentiate " + string(builtins[ins.arg].name));
+            case Op::reduce: error("grad cannot differentiate " + string(builtins[p.reductions[ins.arg].builtin].name));
+            case Op::grad: error("grad cannot differentiate grad");
+            default: error("Bad instruction");  // arrays were refused when compiling
+        }
+    }
+    return stack.data() + 1;
+}
+
+//------------------------------------------------------------------------------
+
+// This section keeps defined variables up to date
+
+/* A definition keeps its Program and the slots it loads, so the variables form a graph from
+   inputs to users. Changing a variable only marks its users stale (and theirs, transitively);
+   they are recomputed when a statement loads them, inputs first, so an edit costs as much as
+   the variables that are actually used afterwards. A definition that uses its own name
+   (n = n + 1) is a plain value, computed once as before. */
+
+inline Definition &Session::definition(int slot) {
+    if (definitions.size() <= size_t(slot)) definitions.resize(symbols.names.size());
+    return definitions[slot];
+}
+
+/* Forget the formula of slot, it no longer uses its inputs */
+inline void Session::unlink(int slot) {
+    Definition &d = definition(slot);
+    for (int input : d.inputs) {
+        vector<int> &users = definition(input).users;
+        users.erase(find(users.begin(), users.end(), slot));
+    }
+    d.formula.reset();
+    d.inputs.clear();
+    d.stale = false;
+}
+
+/* The first of these slots computed from slot, directly or through other formulas, or -1. Searching
+   from slot towards its users is quick for new names and leaves, which have none. */
+inline int Session::used_by(int slot, const vector<int> &slots) {
+    if (definition(slot).users.empty()) return -1;
+    vector<char> seen(symbols.names.size());
+    vector<int> todo = definitions[slot].users;
+    while (!todo.empty()) {
+        int s = todo.back();
+        todo.pop_back();
+        if (seen[s]) continue;
+        if (find(slots.begin(), slots.end(), s) != slots.end()) return s;
+        seen[s] = true;
+        todo.insert(todo.end(), definitions[s].users.begin(), definitions[s].users.end());
+    }
+    return -1;
+}
+
+inline void Session::define(const Program &p) {
+    vector<int> inputs;
+    for_each_load(p, [&](const Instr &ins) {
+        if (find(inputs.begin(), inputs.end(), ins.arg) == inputs.end()) inputs.push_back(ins.arg);
+    });
+    bool self = find(inputs.begin(), inputs.end(), p.target) != inputs.end();
+    int cycle = self ? -1 : used_by(p.target, inputs);
+    if (cycle >= 0) error("Circular definition, \"" + symbols.names[cycle] + "\" is computed from \"" + symbols.names[p.target] + "\"");
+    unlink(p.target);
+    if (self || inputs.empty()) return;  // nothing to recompute it from
+    for (int input : inputs) definition(input).users.push_back(p.target);
+    Definition &d = definition(p.target);
+    d.formula = make_shared<const Program>(p);
+    d.inputs = move(inputs);
+}
+
+inline void Session::assign(int slot, double val) {
+    unlink(slot);
+    symbols.set(slot, val);
+    changed(slot);
+}
+
+inline void Session::changed(int slot) {
+    vector<int> todo = definition(slot).users;
+    while (!todo.empty()) {
+        Definition &d = definitions[todo.back()];
+        todo.pop_back();
+        if (d.stale) continue;  // its users are stale already
+        d.stale = true;
+        todo.insert(todo.end(), d.users.begin(), d.users.end());
+    }
+}
+
+/* Recompute slot after its stale inputs, in topological order without recursion */
+inline void Session::recompute(int slot) {
+    vector<pair<int, size_t>> path {{slot, 0}};  // a slot and the next of its inputs to look at
+    while (!path.empty()) {
+        int s = path.back().first;
+        const Definition &d = definitions[s];
+        if (path.back().second < d.inputs.size()) {
+            int input = d.inputs[path.back().second++];
+            if (definitions[input].stale) path.push_back({input, 0});
+            continue;
+        }
+        const Program *p = d.formula.get();
+        Program retyped;
+        try {
+            if (!loads_match(*p, symbols)) {  // an input has turned from a number into an array or back
+                retyped = *p;
+                retyped.is_array = false;
+                for (Instr &ins : retyped.code) {
+                    if (ins.op == Op::load || ins.op == Op::load_array) ins.op = symbols.kinds[ins.arg] == Kind::array ? Op::load_array : Op::load;
+                    retyped.is_array = retyped.is_array || ins.op == Op::load_array || ins.op == Op::linspace || ins.op == Op::rand_array;
+                }
+                if (!loads_match(retyped, symbols)) error("\"" + symbols.names[s] + "\" sums over an array now, define it again");
+                p = &retyped;
+            }
+            if (p->is_array) symbols.set_array(s, evaluate_array(*p, *this));
+            else symbols.set(s, evaluate(*p, *this));
+        }
+        catch (exception &e) {  // the slots waiting on this one fail for the same reason
+            for (auto &waiting : path) definitions[waiting.first].failure = e.what();
+            throw;
+        }
+        definitions[s].stale = false;
+        path.pop_back();
+    }
+}
+
+inline void Session::update(const Program &p) {
+    for_each_load(p, [&](const Instr &ins) { if (is_stale(ins.arg)) recompute(ins.arg); });
+}
+
+/* Variables that cannot be recomputed stay stale, with the reason in failure() */
+inline void Session::update() {
+    for (size_t s = 0; s < definitions.size(); s++) {
+        try {
+            if (definitions[s].stale) recompute(int(s));
+        }
+        catch (exception &) {}
+    }
+}
+
+#endif
@@ -0,0 +1,688 @@
+/*
+Calculator formulas compiled by the C++ compiler, for code that embeds formulas as strings
+
+formula() parses the same grammar as the Compiler in calculator.h, but in a constexpr
+function, so a literal formula costs nothing at run time and a mistake in it is a
+compile error. Names listed after the text are the variables of the formula:
+
+    constexpr double rad = formula("2 * pi / 180")();                   // computed by the compiler
+    static constexpr auto f = formula("sind(a) * r^2 + log2(r)", "a", "r");
+    constexpr double y = f(30, 4);                                      // also computed by the compiler
+    double z = run_formula<f>(angle, radius);                           // unrolled into plain inline code
+
+Calling a Formula evaluates it with the constexpr math below, which agrees with the
+standard library to about an ulp, gamma to a few. run_formula<f>() needs f to
+be a constexpr variable with static storage; every instruction becomes a template
+instance, so the compiler sees straight-line code calling the same special operations
+as the calculator. rand, seed and linspace are not available in formulas.
+*/
+
+#ifndef FORMULA_H
+#define FORMULA_H
+
+#include <limits>
+#include "calculator.h"
+
+//------------------------------------------------------------------------------
+
+// This section contains math functions that can run inside the compiler
+
+constexpr long double const_pi = 3.14159265358979323846264338327950288L;
+constexpr long double const_ln2 = 0.693147180559945309417232121458176568L;
+constexpr double const_nan = numeric_limits<double>::quiet_NaN();
+constexpr double const_inf = numeric_limits<double>::infinity();
+
+constexpr bool const_is_integer(double x) {
+    if (x != x || x == const_inf || x == -const_inf) return false;
+    if (x > 9e18 || x < -9e18) return true;  // no fraction bits left
+    return x == double((long long)x);
+}
+
+constexpr double const_sqrt(double x) {
+    if (x != x || x < 0) return const_nan;
+    if (x == 0 || x == const_inf) return x;
+    long double m = x, scale = 1;
+    while (m >= 4) { m /= 4; scale *= 2; }  // sqrt(m * 4^k) = sqrt(m) * 2^k, both exact
+    while (m < 1) { m *= 4; scale /= 2; }
+    long double r = m;
+    for (int i = 0; i < 10; i++) r = (r + m / r) / 2;  // Newton, quadratic from r = m
+    return double(r * scale);
+}
+
+constexpr long double const_expl(long double x) {
+    if (x > 11400) return const_inf;
+    if (x < -11400) return 0;
+    long long k = (long long)(x / const_ln2 + (x < 0 ? -0.5L : 0.5L));
+    long double r = x - k * const_ln2, term = 1, sum = 1;  // e^x = 2^k * e^r, |r| <= ln2 / 2
+    for (int n = 1; n < 30; n++) {
+        term *= r / n;
+        sum += term;
+    }
+    for (; k > 0; k--) sum *= 2;
+    for (; k < 0; k++) sum /= 2;
+    return sum;
+}
+
+constexpr long double const_logl(long double x) {  // x > 0 and finite
+    long long k = 0;
+    for (; x > 1.41421356237309504880L; k++) x /= 2;
+    for (; x < 0.70710678118654752440L; k--) x *= 2;
+    long double s = (x - 1) / (x + 1), s2 = s * s, term = s, sum = 0;  // log x = 2 atanh(s)
+    for (int n = 1; n < 60; n += 2) {
+        sum += term / n;
+        term *= s2;
+    }
+    return 2 * sum + k * const_ln2;
+}
+
+constexpr double const_log(double x) {
+    if (x != x || x < 0) return const_nan;
+    if (x == 0) return -const_inf;
+    if (x == const_inf) return x;
+    return double(const_logl(x));
+}
+
+/* sin(x) for |x| <= pi / 4, or cos(x) with cosine */
+constexpr long double const_taylor(long double x, bool cosine) {
+    long double x2 = x * x, term = cosine ? 1 : x, sum = 0;
+    for (int n = cosine ? 0 : 1; n < 30; n += 2) {
+        sum += term;
+        term *= -x2 / ((n + 1) * (n + 2));
+    }
+    return sum;
+}
+
+/* 2 / pi in pieces of 24 bits, the sum of two_over_pi[j] * 2^(-24 (j + 1)) */
+constexpr long long two_over_pi[] = {
+    0xA2F983, 0x6E4E44, 0x1529FC, 0x2757D1, 0xF534DD, 0xC0DB62, 0x95993C, 0x439041, 0xFE5163, 0xABDEBB, 0xC561B7,
+    0x246E3A, 0x424DD2, 0xE00649, 0x2EEA09, 0xD1921C, 0xFE1DEB, 0x1CB129, 0xA73EE8, 0x8235F5, 0x2EBB44, 0x84E99C,
+    0x7026B4, 0x5F7E41, 0x3991D6, 0x398353, 0x39F49C, 0x845F8B, 0xBDF928, 0x3B1FF8, 0x97FFDE, 0x05980F, 0xEF2F11,
+    0x8B5A0A, 0x6D1F6D, 0x367ECF, 0x27CB09, 0xB74F46, 0x3F669E, 0x5FEA2D, 0x7527BA, 0xC7EBE5, 0xF17B3D, 0x0739F7,
+    0x8A5292, 0xEA6BFB, 0x5FB11F, 0x8D5D08
+};
+
+/* r with x = n pi / 2 + r and |r| <= pi / 4, for the large x where pi / 2 in two parts is not enough.
+   x = m 2^e for an integer m, and m times the pieces of 2 / pi is worked out exactly: the pieces
+   whose products are multiples of 4 are left out, the next 8 leave over 160 bits of the fraction,
+   which is enough for the arguments closest to a multiple of pi / 2 (Payne and Hanek). */
+constexpr long double const_reduce_large(double x, long long &n) {
+    double m = x < 0 ? -x : x;
+    int e = 0;
+    for (; m >= 0x1p53; e++) m /= 2;
+    for (; m < 0x1p52; e--) m *= 2;
+    long long mi = (long long)m;
+    long long md[3] = {mi & 0xffffff, (mi >> 24) & 0xffffff, mi >> 48};
+    int first = e >= 26 ? (e - 26) / 24 + 1 : 0;  // pieces before it only add multiples of 4 to x * 2 / pi
+    long long p[11] {};  // the product in digits of 24 bits, lowest first
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 8; k++) p[i + k] += md[i] * two_over_pi[first + 7 - k];
+    }
+    for (int i = 0; i < 10; i++) {
+        p[i + 1] += p[i] >> 24;
+        p[i] &= 0xffffff;
+    }
+    int point = 24 * (first + 8) - e;  // bits of the product below the binary point
+    auto bit = [&](int b) { return (p[b / 24] >> (b % 24)) & 1; };
+    long long up = bit(point - 1);  // rounds to the nearest n, the fraction is then 1 - its bits
+    long double f = 0, w = 1;
+    for (int b = point - 1; b >= 0; b--) {
+        w /= 2;
+        if (bit(b) != up) f += w;
+    }
+    if (up) f = -(f + w);
+    n = bit(point) + 2 * bit(point + 1) + up;
+    long double r = f * (const_pi / 2);
+    if (x < 0) {
+        n = -n;
+        r = -r;
+    }
+    return r;
+}
+
+/* sin(x), or cos(x) with cosine, after reducing x by multiples of pi / 2 */
+constexpr long double const_sincos(double x, bool cosine) {
+    if (x != x || x == const_inf || x == -const_inf) return const_nan;
+    const long double half_pi_hi = 1.570796326734125614166259765625L;  // 33 bits, so n * half_pi_hi is exact
+    const long double half_pi_lo = 6.07710050650619260147514420985847e-11L;
+    long long n = 0;
+    long double r = 0;
+    if (x > 1e9 || x < -1e9) r = const_reduce_large(x, n);
+    else {
+        long double q = x / (const_pi / 2);
+        n = (long long)(q + (q < 0 ? -0.5L : 0.5L));
+        r = (x - n * half_pi_hi) - n * half_pi_lo;
+    }
+    switch ((n + cosine) & 3) {
+        case 0: return const_taylor(r, false);
+        case 1: return const_taylor(r, true);
+        case 2: return -const_taylor(r, false);
+        default: return -const_taylor(r, true);
+    }
+}
+
+/* fmod(x, 360) of a finite x, exact: 360 * 2^k is taken away from the largest k down */
+constexpr double const_fmod360(double x) {
+    double a = x < 0 ? -x : x, step = 360;
+    while (step * 2 <= a) step *= 2;
+    for (; step >= 360; step /= 2) {
+        if (a >= step) a -= step;  // a < 2 step, so the difference is exact
+    }
+    return x < 0 ? -a : a;
+}
+
+/* sincos_deg() of simd.h: x = 90 q + y exactly with |y| <= 45, so multiples of 90 give exact zeros and ones */
+constexpr void const_sincos_deg(double x, double &s, double &c) {
+    if (x != x || x == const_inf || x == -const_inf) {
+        s = c = const_nan;
+        return;
+    }
+    if (!(x < deg_limit && x > -deg_limit)) x = const_fmod360(x);
+    double q = (x * (1.0 / 90) + 0x1.8p52) - 0x1.8p52;
+    double y = x - q * 90;
+    long double z = y * (const_pi / 180), sin0 = const_taylor(z, false), cos0 = const_taylor(z, true);
+    switch ((long long)q & 3) {
+        case 0: s = double(sin0); c = double(cos0); break;
+        case 1: s = double(cos0); c = double(-sin0); break;
+        case 2: s = double(-sin0); c = double(-cos0); break;
+        default: s = double(-cos0); c = double(sin0); break;
+    }
+    s += 0;  // -0 becomes 0, as in simd.h
+    c += 0;
+}
+
+constexpr double const_pow(double x, double y) {
+    if (y == 0) return 1;
+    if (const_is_integer(y) && y < 2147483648.0 && y > -2147483648.0) {  // repeated squaring
+        long double r = 1, b = x;
+        for (long long e = y < 0 ? -(long long)y : (long long)y; e; e >>= 1) {
+            if (e & 1) r *= b;
+            b *= b;
+        }
+        return double(y < 0 ? 1 / r : r);
+    }
+    if (x != x || y != y) return const_nan;
+    if (x < 0) return const_nan;  // a complex number
+    if (x == 0) return y > 0 ? 0 : const_inf;
+    if (x == const_inf) return y > 0 ? const_inf : 0;
+    return double(const_expl(y * const_logl(x)));
+}
+
+/* sin(pi x), exact at the integers */
+constexpr long double const_sinpi(long double x) {
+    long long k = (long long)x;
+    long double f = x - k;  // sin(pi (k + f)) = (-1)^k sin(pi f), |f| < 1
+    long double s = f < 0 ? -1 : 1;
+    if (f < 0) f = -f;
+    if (f > 0.5L) f = 1 - f;
+    long double r = f <= 0.25L ? const_taylor(const_pi * f, false) : const_taylor(const_pi * (0.5L - f), true);
+    return (k & 1) ? -s * r : s * r;
+}
+
+/* Coefficients of Stirling's series, B2k / (2k (2k - 1)) */
+constexpr long double stirling[] = {
+    1.0L / 12, -1.0L / 360, 1.0L / 1260, -1.0L / 1680, 1.0L / 1188, -691.0L / 360360, 1.0L / 156, -3617.0L / 122400
+};
+
+/* log|gamma(x)|, and the sign of gamma(x) in sign */
+constexpr long double const_lgammal(long double x, int &sign) {
+    if (x < 0.5L) {  // reflection, gamma(x) gamma(1 - x) = pi / sin(pi x)
+        long double s = const_sinpi(x);
+        long double r = const_logl(const_pi / (s < 0 ? -s : s)) - const_lgammal(1 - x, sign);
+        if (s < 0) sign = -sign;
+        return r;
+    }
+    sign = 1;
+    long double shift = 1;
+    for (; x < 15; x += 1) shift *= x;  // gamma(x) = gamma(x + n) / (x (x + 1) ... (x + n - 1))
+    long double inv = 1 / x, term = inv, sum = 0;
+    for (long double c : stirling) {
+        sum += c * term;
+        term *= inv * inv;
+    }
+    return (x - 0.5L) * const_logl(x) - x + 0.918938533204672741780329736405617640L + sum - const_logl(shift);
+}
+
+constexpr double const_gamma(double x) {
+    if (x != x) return x;
+    if (x <= 0 && const_is_integer(x)) error("Inf");
+    if (x > 172) return const_inf;
+    int sign = 1;
+    long double l = const_lgammal(x, sign);
+    return double(sign * const_expl(l));
+}
+
+constexpr double const_lgamma(double x) {
+    if (x != x || x == const_inf || x == -const_inf) return x == x ? const_inf : x;
+    if (x <= 0 && const_is_integer(x)) error("Inf");
+    int sign = 1;
+    return double(const_lgammal(x, sign));
+}
+
+constexpr double const_factorial(double n) {
+    if (!const_is_integer(n)) return n == const_inf ? n : const_gamma(n + 1);
+    if (n < 0) error("Inf");
+    if (n >= size(factorials)) return const_inf;
+    return factorials[int(n)];
+}
+
+constexpr double const_abs(double x) {
+    return x < 0 ? -x : x;
+}
+
+/* The special operations of calculator.h, with the same exact zeros and errors */
+constexpr double const_call(int index, double x) {
+    double s = 0, c = 0;
+    switch (index) {
+        case find_builtin("sqrt"): return const_sqrt(x);
+        case find_builtin("log"): case find_builtin("loge"): return const_log(x);
+        case find_builtin("gamma"): return const_gamma(x);
+        case find_builtin("lgamma"): return const_lgamma(x);
+        case find_builtin("sin"): {
+            if (near_multiple_of_pi(x, 0)) return 0;
+            return double(const_sincos(x, false));
+        }
+        case find_builtin("cos"): {
+            if (near_multiple_of_pi(x, 0.5)) return 0;
+            return double(const_sincos(x, true));
+        }
+        case find_builtin("tan"): {
+            if (near_multiple_of_pi(x, 0)) return 0;
+            if (near_multiple_of_pi(x, 0.5)) error("Inf");
+            return double(const_sincos(x, false) / const_sincos(x, true));
+        }
+        case find_builtin("cot"): {
+            if (near_multiple_of_pi(x, 0)) error("Inf");
+            if (near_multiple_of_pi(x, 0.5)) return 0;
+            return double(const_sincos(x, true) / const_sincos(x, false));
+        }
+        case find_builtin("sind"): const_sincos_deg(x, s, c); return s;
+        case find_builtin("cosd"): const_sincos_deg(x, s, c); return c;
+        case find_builtin("tand"): {
+            const_sincos_deg(x, s, c);
+            if (c == 0) error("Inf");
+            return s / c;
+        }
+        case find_builtin("cotd"): {
+            const_sincos_deg(x, s, c);
+            if (s == 0) error("Inf");
+            return c / s;
+        }
+        default: error("\"" + string(builtins[index].name) + "\" is not available in formulas");
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// This section compiles formulas
+
+const int formula_capacity = 64;  // instructions in one Formula
+
+/* A compiled formula of N variables, the same stack machine code as a Program */
+template<int N>
+struct Formula
+{
+    Instr code[formula_capacity] {};
+    double consts[formula_capacity] {};
+    int size {0};
+    int depth {0};
+    static constexpr int variables = N;
+
+    template<class... X>
+    constexpr double operator()(X... x) const;
+};
+
+/* Evaluate with the constexpr math, at compile time when the arguments are constants */
+template<int N>
+template<class... X>
+constexpr double Formula<N>::operator()(X... x) const {
+    static_assert(sizeof...(X) == N, "a formula takes one argument for each of its variables");
+    double values[N + 1] {double(x)...};
+    double st[formula_capacity] {};
+    int sp = 0;
+    for (int i = 0; i < size; i++) {
+        Instr ins = code[i];
+        switch (ins.op) {
+            case Op::push: st[sp++] = consts[ins.arg]; break;
+            case Op::load: st[sp++] = values[ins.arg]; break;
+            case Op::neg: st[sp - 1] = -st[sp - 1]; break;
+            case Op::add: sp--; st[sp - 1] += st[sp]; break;
+            case Op::sub: sp--; st[sp - 1] -= st[sp]; break;
+            case Op::mul: sp--; st[sp - 1] *= st[sp]; break;
+            case Op::div: {
+                sp--;
+                if (st[sp] == 0) error("Inf");
+                st[sp - 1] /= st[sp];
+                break;
+            }
+            case Op::rem: {
+                sp--;
+                double d = st[sp], left = st[sp - 1];
+                if (d == 0) error("Inf");
+                st[sp - 1] = left - d * int(left / d);
+                break;
+            }
+            case Op::pow: sp--; st[sp - 1] = const_pow(st[sp - 1], st[sp]); break;
+            case Op::powi: st[sp - 1] = const_pow(st[sp - 1], ins.arg); break;
+            case Op::fact: st[sp - 1] = const_factorial(st[sp - 1]); break;
+            case Op::call1: st[sp - 1] = const_call(ins.arg, st[sp - 1]); break;
+            default: error("Bad instruction");
+        }
+    }
+    return st[0];
+}
+
+/* A number such as 12, .5 or 1.5e-3 starting at s[i], to within an ulp of what istream reads */
+constexpr double parse_number(string_view s, size_t &i) {
+    long double mantissa = 0;
+    int exponent = 0;
+    bool digits = false;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; i++, digits = true) mantissa = mantissa * 10 + (s[i] - '0');
+    if (i < s.size() && s[i] == '.') {
+        for (i++; i < s.size() && s[i] >= '0' && s[i] <= '9'; i++, digits = true, exponent--) mantissa = mantissa * 10 + (s[i] - '0');
+    }
+    if (!digits) error("Bad number");
+    if (i + 1 < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+        size_t j = i + 1;
+        bool negative = s[j] == '-';
+        if (s[j] == '-' || s[j] == '+') j++;
+        if (j < s.size() && s[j] >= '0' && s[j] <= '9') {
+            int e = 0;
+            for (; j < s.size() && s[j] >= '0' && s[j] <= '9'; j++) e = min(e * 10 + (s[j] - '0'), 100000);
+            exponent += negative ? -e : e;
+            i = j;
+        }
+    }
+    long double scale = 1;
+    for (int k = exponent < 0 ? -exponent : exponent; k > 0 && scale < 1e4900L; k--) scale *= 10;
+    return double(exponent < 0 ? mantissa / scale : mantissa * scale);
+}
+
+/* A Token read by Formula_compiler, name points into the formula */
+struct Formula_token
+{
+    char key {print};
+    double value {0};
+    int index {-1};  // variable number or position in builtins[]
+    string_view name;
+};
+
+/* The Compiler of calculator.h as constexpr code, writing into a Formula */
+template<int N>
+class Formula_compiler
+{
+    private:
+        string_view s;
+        size_t pos {0};
+        const string_view *names;
+        Formula<N> &f;
+        int sp {0};
+        bool full {false};
+        Formula_token buffer;
+
+        constexpr Formula_token get_token();
+        constexpr void putback(Formula_token t);
+        constexpr void emit(Op op, int arg = 0);
+        constexpr void push(double val);
+        constexpr int arguments();
+        constexpr void switch_operation(const Formula_token &t);
+        constexpr void primary();
+        constexpr void power();
+        constexpr void term();
+        constexpr void expression();
+    public:
+        constexpr Formula_compiler(string_view text, const string_view *variables, Formula<N> &formula): s(text), names(variables), f(formula) {}
+        constexpr void statement();
+};
+
+template<int N>
+constexpr Formula_token Formula_compiler<N>::get_token() {
+    if (full) {
+        full = false;
+        return buffer;
+    }
+    while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r')) pos++;
+    Formula_token t;
+    if (pos == s.size() || s[pos] == print) return t;
+
+    char ch = s[pos];
+    switch (ch) {
+        case '(': case ')': case '+': case '-': case '*': case '/': case '%': case '^': case '!': case ',': {
+            pos++;
+            t.key = ch;
+            return t;
+        }
+        case '.':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': {
+            t.key = number;
+            t.value = parse_number(s, pos);
+            return t;
+        }
+    }
+    if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z'))) error("Bad token");
+    size_t start = pos;
+    while (pos < s.size() && ((s[pos] >= 'a' && s[pos] <= 'z') || (s[pos] >= 'A' && s[pos] <= 'Z') || (s[pos] >= '0' && s[pos] <= '9') || s[pos] == '_')) pos++;
+    t.name = s.substr(start, pos - start);
+    size_t next = pos;
+    while (next < s.size() && (s[next] == ' ' || s[next] == '\t')) next++;
+    if (next < s.size() && s[next] == '=') error("Formulas cannot define variables");
+
+    for (int i = 0; i < N; i++) {
+        if (names[i] == t.name) {
+            t.key = variable;
+            t.index = i;
+            return t;
+        }
+    }
+    t.key = special;
+    t.index = find_builtin(t.name);
+    if (t.index >= 0) return t;
+    if (t.name.size() > 3 && t.name.substr(0, 3) == "log") {  // logN(x) = log(x) / log(N)
+        size_t i = 3;
+        double b = parse_number(t.name, i);
+        if (i == t.name.size()) {
+            t.value = const_log(b);
+            return t;
+        }
+    }
+    error("No such variable \"" + string(t.name) + "\"");
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::putback(Formula_token t) {
+    if (full) error("Token stream already full, cannot put back");
+    buffer = t;
+    full = true;
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::emit(Op op, int arg) {
+    if (f.size == formula_capacity) error("Formula too long");
+    f.code[f.size++] = {op, arg};
+    sp += stack_effect(op);
+    f.depth = max(f.depth, sp);
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::push(double val) {
+    int i = f.size;
+    emit(Op::push, i);
+    f.consts[i] = val;
+}
+
+/* Arguments of a special operation: (a) or (a, b), or a single primary as in sqrt 4 */
+template<int N>
+constexpr int Formula_compiler<N>::arguments() {
+    Formula_token t = get_token();
+    if (t.key != '(') {
+        putback(t);
+        primary();
+        return 1;
+    }
+    int n = 0;
+    while (true) {
+        expression();
+        n++;
+        t = get_token();
+        if (t.key == ')') return n;
+        if (t.key != ',') error("')' expected");
+    }
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::switch_operation(const Formula_token &t) {
+    if (t.index < 0) {  // logN
+        if (arguments() != 1) error("\"" + string(t.name) + "\" takes 1 argument");
+        emit(Op::call1, log_builtin);
+        push(t.value);
+        emit(Op::div);
+        return;
+    }
+    const Builtin &b = builtins[t.index];
+    if (b.type == Builtin_type::constant) {
+        push(b.value);
+        return;
+    }
+    if (b.type != Builtin_type::function || t.index == rand_builtin || t.index == seed_builtin) {
+        error("\"" + string(t.name) + "\" is not available in formulas");
+    }
+    if (arguments() != 1) error("Wrong number of arguments for \"" + string(t.name) + "\"");
+    emit(Op::call1, t.index);
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::primary() {
+    Formula_token t = get_token();
+    switch (t.key) {
+        case '(': {
+            expression();
+            t = get_token();
+            if (t.key != ')') error("')' expected");
+            return;
+        }
+        case number: push(t.value); return;
+        case variable: emit(Op::load, t.index); return;
+        case '+': case '-': {
+            Formula_token next = get_token();
+            if (next.key == '+' || next.key == '-') error("more than 1 consecutive '+' or '-' makes no sense");
+            putback(next);
+            primary();
+            if (t.key == '-') emit(Op::neg);
+            return;
+        }
+        case special: switch_operation(t); return;
+        default: error("primary expected");
+    }
+}
+
+/* ^ and ! apply to the primary right before them, x^k for small integers k is a few multiplications */
+template<int N>
+constexpr void Formula_compiler<N>::power() {
+    primary();
+    while (true) {
+        Formula_token t = get_token();
+        if (t.key == '!') {
+            emit(Op::fact);
+            continue;
+        }
+        if (t.key != '^') {
+            putback(t);
+            return;
+        }
+        primary();
+        Instr last = f.code[f.size - 1];
+        double k = f.consts[last.arg];
+        if (last.op == Op::push && const_is_integer(k) && const_abs(k) <= 16) {  // replaces the push
+            f.size--;
+            sp--;
+            emit(Op::powi, int(k));
+        }
+        else emit(Op::pow);
+    }
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::term() {
+    power();
+    while (true) {
+        Formula_token t = get_token();
+        switch (t.key) {
+            case '*': power(); emit(Op::mul); break;
+            case '/': power(); emit(Op::div); break;
+            case '%': power(); emit(Op::rem); break;
+            default: putback(t); return;
+        }
+    }
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::expression() {
+    term();
+    while (true) {
+        Formula_token t = get_token();
+        switch (t.key) {
+            case '+': term(); emit(Op::add); break;
+            case '-': term(); emit(Op::sub); break;
+            default: putback(t); return;
+        }
+    }
+}
+
+template<int N>
+constexpr void Formula_compiler<N>::statement() {
+    expression();
+    if (get_token().key != print) error("Bad token");
+}
+
+/* Compile text with the variables named after it, in the order the Formula takes them */
+template<class... Names>
+constexpr Formula<sizeof...(Names)> formula(string_view text, Names... variables) {
+    Formula<sizeof...(Names)> f;
+    const string_view names[sizeof...(Names) + 1] {string_view(variables)...};
+    Formula_compiler<sizeof...(Names)>(text, names, f).statement();
+    return f;
+}
+
+//------------------------------------------------------------------------------
+
+// This section turns a constexpr Formula into inline code
+
+/* Instruction I of F, with SP values on the stack, followed by the rest of F */
+template<const auto &F, int I, int SP>
+inline void run_formula_from(double *st, const double *x) {
+    if constexpr (I < F.size) {
+        constexpr Instr ins = F.code[I];
+        if constexpr (ins.op == Op::push) st[SP] = F.consts[ins.arg];
+        else if constexpr (ins.op == Op::load) st[SP] = x[ins.arg];
+        else if constexpr (ins.op == Op::neg) st[SP - 1] = -st[SP - 1];
+        else if constexpr (ins.op == Op::add) st[SP - 2] += st[SP - 1];
+        else if constexpr (ins.op == Op::sub) st[SP - 2] -= st[SP - 1];
+        else if constexpr (ins.op == Op::mul) st[SP - 2] *= st[SP - 1];
+        else if constexpr (ins.op == Op::div) {
+            if (st[SP - 1] == 0) error("Inf");
+            st[SP - 2] /= st[SP - 1];
+        }
+        else if constexpr (ins.op == Op::rem) {
+            double d = st[SP - 1], left = st[SP - 2];
+            if (d == 0) error("Inf");
+            st[SP - 2] = left - d * int(left / d);
+        }
+        else if constexpr (ins.op == Op::pow) st[SP - 2] = pow(st[SP - 2], st[SP - 1]);
+        else if constexpr (ins.op == Op::powi) st[SP - 1] = power_int(st[SP - 1], ins.arg);
+        else if constexpr (ins.op == Op::fact) st[SP - 1] = factorial(st[SP - 1]);
+        else if constexpr (ins.op == Op::call1) st[SP - 1] = builtins[ins.arg].fn1(st[SP - 1]);
+        run_formula_from<F, I + 1, SP + stack_effect(ins.op)>(st, x);
+    }
+}
+
+/* Evaluate F with the run-time special operations of the calculator, F must be a constexpr variable */
+template<const auto &F, class... X>
+inline double run_formula(X... x) {
+    static_assert(sizeof...(X) == F.variables, "a formula takes one argument for each of its variables");
+    const double values[sizeof...(X) + 1] {double(x)...};
+    double st[F.depth > 0 ? F.depth : 1];
+    run_formula_from<F, 0, 0>(st, values);
+    return st[0];
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+Random number engine behind rand() and seed() in calculator.h
+
+One engine lives per thread and is seeded once, from random_device unless seed(n)
+is called, so Monte Carlo runs can be repeated. xoshiro256++ is the default;
+PCG32 and the standard mt19937_64 can be chosen with Random_engine::use(). The 5 KB
+state of mt19937_64 is only made and seeded in the engines that choose it.
+*/
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+
+enum class Generator : unsigned char
+{
+    xoshiro,  // xoshiro256++, 256 bits of state
+    pcg,      // PCG32 (XSH RR), two outputs per double
+    mt,       // mt19937_64, as in the standard library
+};
+
+inline Generator default_generator = Generator::xoshiro;  // for engines created from now on
+
+class Random_engine
+{
+    private:
+        Generator gen {default_generator};
+        uint64_t s[4];       // xoshiro256++ state
+        uint64_t pcg_state;
+        uint64_t pcg_inc;    // must be odd
+        uint64_t seeded;     // the last seed, for an mt made after it
+        std::unique_ptr<std::mt19937_64> mt;  // null until Generator::mt is chosen
+
+        static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+        uint64_t next_xoshiro();
+        uint32_t next_pcg();
+    public:
+        Random_engine() {
+            seed(std::random_device{}() * 0x100000000ull + std::random_device{}());
+            use(gen);
+        }
+        void seed(uint64_t n);
+        void use(Generator g);
+        Generator generator() const { return gen; }
+        uint64_t next();
+        double uniform(double lb, double ub) { return lb + (ub - lb) * ((next() >> 11) * 0x1.0p-53); }
+        void fill(double *out, int n, double lb, double ub);
+};
+
+/* Expands one seed into the state of every generator, so all of them are reproducible */
+inline void Random_engine::seed(uint64_t n) {
+    uint64_t x = n;
+    for (uint64_t &word : s) {  // splitmix64, as recommended for seeding xoshiro
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        word = z ^ (z >> 31);
+    }
+    pcg_state = s[0];
+    pcg_inc = s[1] | 1;
+    seeded = n;
+    if (mt) mt->seed(n);
+}
+
+inline void Random_engine::use(Generator g) {
+    gen = g;
+    if (g == Generator::mt && !mt) mt = std::make_unique<std::mt19937_64>(seeded);
+}
+
+inline uint64_t Random_engine::next_xoshiro() {
+    uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+inline uint32_t Random_engine::next_pcg() {
+    uint64_t old = pcg_state;
+    pcg_state = old * 6364136223846793005ull + pcg_inc;
+    uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    uint32_t rot = uint32_t(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+inline uint64_t Random_engine::next() {
+    switch (gen) {
+        case Generator::pcg: return (uint64_t(next_pcg()) << 32) | next_pcg();
+        case Generator::mt: return (*mt)();
+        default: return next_xoshiro();
+    }
+}
+
+/* n numbers uniformly from lb to ub, choosing the generator once for the whole block */
+inline void Random_engine::fill(double *out, int n, double lb, double ub) {
+    double scale = (ub - lb) * 0x1.0p-53;
+    switch (gen) {
+        case Generator::pcg: {
+            for (int i = 0; i < n; i++) out[i] = lb + scale * (((uint64_t(next_pcg()) << 32) | next_pcg()) >> 11);
+            break;
+        }
+        case Generator::mt: {
+            for (int i = 0; i < n; i++) out[i] = lb + scale * ((*mt)() >> 11);
+            break;
+        }
+        default: {
+            for (int i = 0; i < n; i++) out[i] = lb + scale * (next_xoshiro() >> 11);
+            break;
+        }
+    }
+}
+
+/* Generator named on the command line, false if there is no such generator */
+inline bool parse_generator(const std::string &name, Generator &g) {
+    if (name == "xoshiro") g = Generator::xoshiro;
+    else if (name == "pcg") g = Generator::pcg;
+    else if (name == "mt") g = Generator::mt;
+    else return false;
+    return true;
+}
+
+inline thread_local Random_engine rng;  // one engine per thread, created on first use
+
+#endif
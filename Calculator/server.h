@@ -0,0 +1,336 @@
+/*
+Server mode of the calculator: one statement per line in, one result per line out
+
+Clients connect to a Unix domain socket, or to a TCP port on 127.0.0.1, and may send
+any number of lines without waiting for the answers (pipelining). Answers come back
+in order, one line for every line sent: the value with all 17 digits, the elements
+of an array separated by spaces, "n elements" for an array definition, an empty line
+for an empty one, or "Error: ..." — errors never close the connection. '$' closes it.
+
+Every connection gets its own variables, a copy of the server's Session taken when it
+connects, so the built-in constants are shared and definitions stay private.
+
+Each worker thread runs an epoll loop over its own connections and takes new ones
+from the shared listening socket, which EPOLLEXCLUSIVE hands to one worker at a time.
+On SIGINT or SIGTERM the workers stop and the request count and latency percentiles
+are printed, latency being the time from reading a request to having its answer.
+
+Linux only.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "calculator.h"
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+
+// This section records latencies
+
+/* Counts of values in buckets with about 6% resolution: exact below 32, then 16 buckets per power of 2 */
+class Latency_histogram
+{
+    private:
+        static const int exact = 32;
+        static const int sub = 16;
+        vector<uint64_t> counts = vector<uint64_t>(exact + 59 * sub);
+        uint64_t total {0};
+        uint64_t largest {0};
+
+        static int bucket(uint64_t v);
+        static uint64_t middle(int i);
+    public:
+        void add(uint64_t v);
+        void merge(const Latency_histogram &h);
+        uint64_t count() const { return total; }
+        uint64_t max() const { return largest; }
+        uint64_t percentile(double q) const;  // q from 0 to 1
+};
+
+inline int Latency_histogram::bucket(uint64_t v) {
+    if (v < exact) return int(v);
+    int shift = 63 - __builtin_clzll(v) - 4;  // leaves v >> shift between 16 and 31
+    return exact + (shift - 1) * sub + int(v >> shift) - sub;
+}
+
+inline uint64_t Latency_histogram::middle(int i) {
+    if (i < exact) return i;
+    int shift = (i - exact) / sub + 1;
+    uint64_t low = uint64_t((i - exact) % sub + sub) << shift;
+    return low + (uint64_t(1) << shift) / 2;
+}
+
+inline void Latency_histogram::add(uint64_t v) {
+    counts[bucket(v)]++;
+    total++;
+    largest = std::max(largest, v);
+}
+
+inline void Latency_histogram::merge(const Latency_histogram &h) {
+    for (size_t i = 0; i < counts.size(); i++) counts[i] += h.counts[i];
+    total += h.total;
+    largest = std::max(largest, h.largest);
+}
+
+inline uint64_t Latency_histogram::percentile(double q) const {
+    uint64_t rank = uint64_t(ceil(q * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= std::max(rank, uint64_t(1))) return std::min(middle(int(i)), largest);
+    }
+    return largest;
+}
+
+//------------------------------------------------------------------------------
+
+// This section contains the server
+
+inline volatile sig_atomic_t server_stopping = 0;
+
+inline void stop_server(int) { server_stopping = 1; }
+
+/* One client, with its own variables and the bytes not handled yet in both directions */
+struct Connection
+{
+    int fd;
+    Session session;
+    int ans;
+    string in;
+    string out;
+    size_t sent {0};  // of out
+    bool closing {false};
+    bool writing {false};  // waiting for EPOLLOUT
+
+    Connection(int f, const Session &base): fd(f), session(base), ans(session.symbols.intern("ans")) {}
+};
+
+class Server
+{
+    private:
+        int listener {-1};
+        string socket_path;  // removed again when the server ends
+        const Session &base;
+        atomic<long> connections {0};
+
+        void work(Latency_histogram &latency);
+        void answer(Connection &c, string_view line);
+        bool receive(Connection &c, Latency_histogram &latency);
+        bool flush(Connection &c, int epoll);
+    public:
+        static const size_t max_line = 1 << 20;  // a client sending more without a newline is dropped
+
+        explicit Server(const Session &s): base(s) {}
+        ~Server();
+        bool listen_unix(const string &path);
+        bool listen_tcp(int port);
+        int serve(unsigned threads);
+};
+
+inline Server::~Server() {
+    if (listener >= 0) close(listener);
+    if (!socket_path.empty()) unlink(socket_path.c_str());
+}
+
+inline bool Server::listen_unix(const string &path) {
+    sockaddr_un addr {};
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());  // left over from an earlier run
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+    socket_path = path;
+    return listen(listener, SOMAXCONN) == 0;
+}
+
+inline bool Server::listen_tcp(int port) {
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(uint16_t(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // local clients only
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    if (listener < 0) return false;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    return bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && listen(listener, SOMAXCONN) == 0;
+}
+
+/* Append the answer to one line, every line gets exactly one */
+inline void Server::answer(Connection &c, string_view line) {
+    char number[32];
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == string_view::npos) {
+        c.out += '\n';
+        return;
+    }
+    if (line[first] == quit) {
+        c.closing = true;
+        return;
+    }
+    Expected<Program> compiled = try_compile(line, c.session);
+    if (!compiled) {
+        c.out += "Error: " + compiled.error() + "\n";
+        return;
+    }
+    const Program &p = *compiled;
+    Symbol_table &symbols = c.session.symbols;
+    try {
+        if (p.is_array) {
+            vector<double> result = run_array(p, c.session);
+            if (p.target >= 0) c.out += to_string(symbols.arrays[p.target].size()) + " elements";
+            for (size_t i = 0; p.target < 0 && i < result.size(); i++) {
+                if (i > 0) c.out += ' ';
+                c.out.append(number, snprintf(number, sizeof(number), "%.17g", result[i]));
+            }
+            c.out += '\n';
+            return;
+        }
+        if (c.session.exact && p.target < 0 && is_integer_program(p, c.session)) {
+            c.out += evaluate_exact(p, c.session).to_string() + "\n";
+            c.session.assign(c.ans, evaluate(p, c.session));
+            return;
+        }
+        double result = run(p, c.session);
+        if (p.target < 0) c.session.assign(c.ans, result);
+        c.out.append(number, snprintf(number, sizeof(number), "%.17g\n", result));
+    }
+    catch (exception &e) {
+        c.out += "Error: " + string(e.what()) + "\n";
+    }
+}
+
+/* Read what the client sent and answer its complete lines, false when the connection is over */
+inline bool Server::receive(Connection &c, Latency_histogram &latency) {
+    char block[1 << 16];
+    bool open = true;
+    while (true) {
+        ssize_t n = read(c.fd, block, sizeof(block));
+        if (n > 0) {
+            c.in.append(block, n);
+            if (c.in.size() > max_line) break;  // answer the lines in it first, epoll reports the rest again
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) open = false;
+        if (n < 0 && errno == EINTR) continue;
+        break;
+    }
+    auto t0 = chrono::steady_clock::now();
+    size_t start = 0;
+    for (size_t nl; !c.closing && (nl = c.in.find('\n', start)) != string::npos; start = nl + 1) {
+        answer(c, string_view(c.in).substr(start, nl - start));
+        latency.add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count());
+    }
+    c.in.erase(0, start);
+    if (c.in.size() > max_line) {
+        c.out += "Error: line too long\n";
+        c.closing = true;
+    }
+    return open;
+}
+
+/* Write as much of the answers as the socket takes, false after an error */
+inline bool Server::flush(Connection &c, int epoll) {
+    while (c.sent < c.out.size()) {
+        ssize_t n = write(c.fd, c.out.data() + c.sent, c.out.size() - c.sent);
+        if (n > 0) c.sent += n;
+        else if (n < 0 && errno == EINTR) continue;
+        else if (n < 0 && errno == EAGAIN) break;
+        else return false;
+    }
+    if (c.sent == c.out.size()) {
+        c.out.clear();
+        c.sent = 0;
+    }
+    bool waiting = !c.out.empty();
+    if (waiting != c.writing) {  // only ask for EPOLLOUT while the socket is full
+        epoll_event ev {};
+        ev.events = EPOLLIN | EPOLLRDHUP | (waiting ? uint32_t(EPOLLOUT) : 0u);
+        ev.data.ptr = &c;
+        epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &ev);
+        c.writing = waiting;
+    }
+    return true;
+}
+
+/* One worker: accept clients and serve them until the server stops */
+inline void Server::work(Latency_histogram &latency) {
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0) return;
+    epoll_event ev {};
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = nullptr;  // the listener
+    epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &ev);
+
+    unordered_map<Connection*, unique_ptr<Connection>> clients;
+    auto drop = [&](Connection *c) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, c->fd, nullptr);
+        close(c->fd);
+        clients.erase(c);
+    };
+    epoll_event events[256];
+    while (!server_stopping) {
+        int n = epoll_wait(epoll, events, 256, 200);  // wake up now and then to see if the server stops
+        for (int i = 0; i < n; i++) {
+            Connection *c = static_cast<Connection*>(events[i].data.ptr);
+            if (!c) {
+                int fd;
+                while ((fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    int on = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));  // fails harmlessly on Unix sockets
+                    auto client = make_unique<Connection>(fd, base);
+                    epoll_event add {};
+                    add.events = EPOLLIN | EPOLLRDHUP;
+                    add.data.ptr = client.get();
+                    epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &add);
+                    clients.emplace(client.get(), move(client));
+                    connections++;
+                }
+                continue;
+            }
+            bool open = true;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) open = receive(*c, latency);
+            if (!flush(*c, epoll) || ((!open || c->closing) && c->out.empty())) drop(c);
+            else if (!open) c->closing = true;  // the client is gone, finish writing and then close
+        }
+    }
+    for (auto &client : clients) close(client.first->fd);
+    close(epoll);
+}
+
+/* Serve until SIGINT or SIGTERM, then print the statistics */
+inline int Server::serve(unsigned threads) {
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    signal(SIGPIPE, SIG_IGN);  // a client closing early must not kill the server
+    auto t0 = chrono::steady_clock::now();
+    vector<Latency_histogram> latency(max(threads, 1u));
+    vector<thread> workers;
+    for (size_t i = 0; i < latency.size(); i++) workers.emplace_back([this, &latency, i] { work(latency[i]); });
+    for (thread &t : workers) t.join();
+
+    Latency_histogram all;
+    for (const Latency_histogram &h : latency) all.merge(h);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    fprintf(stderr, "%ld connections, %llu requests, %.0f requests/sec on %zu threads\n", connections.load(), (unsigned long long)all.count(), all.count() / max(seconds, 1e-9), latency.size());
+    fprintf(stderr, "latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", all.percentile(0.5) / 1e3, all.percentile(0.9) / 1e3, all.percentile(0.99) / 1e3, all.percentile(0.999) / 1e3, all.max() / 1e3);
+    return 0;
+}
+
+#endif
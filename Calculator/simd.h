@@ -0,0 +1,304 @@
+/*
+Element-wise kernels over contiguous blocks of doubles, used by run_array() in calculator.h
+
+An Operand is either a block of n values or a single value broadcast to the whole
+block. AVX is used when the compiler targets it (-mavx, -march=native), otherwise
+SSE2, with a plain loop for the tail of each block.
+*/
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+//------------------------------------------------------------------------------
+
+// This section wraps the instruction set into a Pack of doubles
+
+#if defined(__AVX__)
+
+typedef __m256d Pack;
+const int pack_width = 4;
+inline Pack pack_load(const double *p) { return _mm256_loadu_pd(p); }
+inline Pack pack_set1(double x) { return _mm256_set1_pd(x); }
+inline void pack_store(double *p, Pack v) { _mm256_storeu_pd(p, v); }
+inline Pack pack_add(Pack a, Pack b) { return _mm256_add_pd(a, b); }
+inline Pack pack_sub(Pack a, Pack b) { return _mm256_sub_pd(a, b); }
+inline Pack pack_mul(Pack a, Pack b) { return _mm256_mul_pd(a, b); }
+inline Pack pack_div(Pack a, Pack b) { return _mm256_div_pd(a, b); }
+inline Pack pack_sqrt(Pack a) { return _mm256_sqrt_pd(a); }
+inline bool pack_any_zero(Pack a) { return _mm256_movemask_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_EQ_OQ)) != 0; }
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+typedef __m128d Pack;
+const int pack_width = 2;
+inline Pack pack_load(const double *p) { return _mm_loadu_pd(p); }
+inline Pack pack_set1(double x) { return _mm_set1_pd(x); }
+inline void pack_store(double *p, Pack v) { _mm_storeu_pd(p, v); }
+inline Pack pack_add(Pack a, Pack b) { return _mm_add_pd(a, b); }
+inline Pack pack_sub(Pack a, Pack b) { return _mm_sub_pd(a, b); }
+inline Pack pack_mul(Pack a, Pack b) { return _mm_mul_pd(a, b); }
+inline Pack pack_div(Pack a, Pack b) { return _mm_div_pd(a, b); }
+inline Pack pack_sqrt(Pack a) { return _mm_sqrt_pd(a); }
+inline bool pack_any_zero(Pack a) { return _mm_movemask_pd(_mm_cmpeq_pd(a, _mm_setzero_pd())) != 0; }
+
+#else
+
+struct Pack { double v; };  // no SIMD, one double at a time
+const int pack_width = 1;
+inline Pack pack_load(const double *p) { return {*p}; }
+inline Pack pack_set1(double x) { return {x}; }
+inline void pack_store(double *p, Pack v) { *p = v.v; }
+inline Pack pack_add(Pack a, Pack b) { return {a.v + b.v}; }
+inline Pack pack_sub(Pack a, Pack b) { return {a.v - b.v}; }
+inline Pack pack_mul(Pack a, Pack b) { return {a.v * b.v}; }
+inline Pack pack_div(Pack a, Pack b) { return {a.v / b.v}; }
+inline Pack pack_sqrt(Pack a) { return {__builtin_sqrt(a.v)}; }
+inline bool pack_any_zero(Pack a) { return a.v == 0; }
+
+#endif
+
+//------------------------------------------------------------------------------
+
+// This section contains the kernels
+
+/* A block of values, or one value standing for every element */
+struct Operand
+{
+    const double *data;
+    bool scalar;
+};
+
+/* out[i] = vop(a[i], b[i]), the scalar flags are template arguments so the loop has no branches */
+template<bool AS, bool BS, class V, class S>
+inline void map2_block(const double *a, const double *b, double *out, int n, V vop, S sop) {
+    int i = 0;
+    Pack pa = pack_set1(*a), pb = pack_set1(*b);
+    for (; i + pack_width <= n; i += pack_width) {
+        pack_store(out + i, vop(AS ? pa : pack_load(a + i), BS ? pb : pack_load(b + i)));
+    }
+    for (; i < n; i++) out[i] = sop(a[AS ? 0 : i], b[BS ? 0 : i]);
+}
+
+template<class V, class S>
+inline void map2(Operand a, Operand b, double *out, int n, V vop, S sop) {
+    if (a.scalar) map2_block<true, false>(a.data, b.data, out, n, vop, sop);
+    else if (b.scalar) map2_block<false, true>(a.data, b.data, out, n, vop, sop);
+    else map2_block<false, false>(a.data, b.data, out, n, vop, sop);
+}
+
+inline void vec_add(Operand a, Operand b, double *out, int n) {
+    map2(a, b, out, n, [](Pack x, Pack y) { return pack_add(x, y); }, [](double x, double y) { return x + y; });
+}
+
+inline void vec_sub(Operand a, Operand b, double *out, int n) {
+    map2(a, b, out, n, [](Pack x, Pack y) { return pack_sub(x, y); }, [](double x, double y) { return x - y; });
+}
+
+inline void vec_mul(Operand a, Operand b, double *out, int n) {
+    map2(a, b, out, n, [](Pack x, Pack y) { return pack_mul(x, y); }, [](double x, double y) { return x * y; });
+}
+
+inline void vec_div(Operand a, Operand b, double *out, int n) {
+    map2(a, b, out, n, [](Pack x, Pack y) { return pack_div(x, y); }, [](double x, double y) { return x / y; });
+}
+
+inline void vec_neg(const double *a, double *out, int n) {
+    Pack zero = pack_set1(0);
+    int i = 0;
+    for (; i + pack_width <= n; i += pack_width) pack_store(out + i, pack_sub(zero, pack_load(a + i)));
+    for (; i < n; i++) out[i] = -a[i];
+}
+
+inline void vec_sqrt(const double *a, double *out, int n) {
+    int i = 0;
+    for (; i + pack_width <= n; i += pack_width) pack_store(out + i, pack_sqrt(pack_load(a + i)));
+    for (; i < n; i++) out[i] = __builtin_sqrt(a[i]);
+}
+
+/* a[i]^k for an integer k, by repeated squaring instead of pow() */
+inline void vec_powi(const double *a, long k, double *out, int n) {
+    bool invert = k < 0;
+    unsigned long m = invert ? 0 - (unsigned long)k : (unsigned long)k;
+    Pack one = pack_set1(1);
+    int i = 0;
+    for (; i + pack_width <= n; i += pack_width) {
+        Pack base = pack_load(a + i), r = one;
+        for (unsigned long e = m; e; e >>= 1) {
+            if (e & 1) r = pack_mul(r, base);
+            base = pack_mul(base, base);
+        }
+        pack_store(out + i, invert ? pack_div(one, r) : r);
+    }
+    for (; i < n; i++) {
+        double base = a[i], r = 1;
+        for (unsigned long e = m; e; e >>= 1) {
+            if (e & 1) r *= base;
+            base *= base;
+        }
+        out[i] = invert ? 1 / r : r;
+    }
+}
+
+/* out[i] = start + i, the counter of a reduction. Four counters that stay exact integers,
+   so no addition waits for the one before. */
+inline void vec_iota(double start, double *out, int n) {
+    double first[pack_width];
+    for (int j = 0; j < pack_width; j++) first[j] = j;
+    Pack s = pack_set1(start), step = pack_set1(4 * pack_width), width = pack_set1(pack_width);
+    Pack k0 = pack_load(first), k1 = pack_add(k0, width), k2 = pack_add(k1, width), k3 = pack_add(k2, width);
+    int i = 0;
+    for (; i + 4 * pack_width <= n; i += 4 * pack_width) {
+        pack_store(out + i, pack_add(s, k0));
+        pack_store(out + i + pack_width, pack_add(s, k1));
+        pack_store(out + i + 2 * pack_width, pack_add(s, k2));
+        pack_store(out + i + 3 * pack_width, pack_add(s, k3));
+        k0 = pack_add(k0, step);
+        k1 = pack_add(k1, step);
+        k2 = pack_add(k2, step);
+        k3 = pack_add(k3, step);
+    }
+    for (; i < n; i++) out[i] = start + i;
+}
+
+/* Sum of a[0, n) in 4 * pack_width interleaved lanes, added up pairwise at the end */
+inline double vec_sum(const double *a, int n) {
+    const int lanes = 4 * pack_width;
+    Pack s0 = pack_set1(0), s1 = s0, s2 = s0, s3 = s0;
+    int i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        s0 = pack_add(s0, pack_load(a + i));
+        s1 = pack_add(s1, pack_load(a + i + pack_width));
+        s2 = pack_add(s2, pack_load(a + i + 2 * pack_width));
+        s3 = pack_add(s3, pack_load(a + i + 3 * pack_width));
+    }
+    double l[lanes];
+    pack_store(l, pack_add(s0, s1));
+    pack_store(l + pack_width, pack_add(s2, s3));
+    for (int w = pack_width; w > 0; w /= 2) {  // l[0, 2w) to l[0, w)
+        for (int j = 0; j < w; j++) l[j] = l[j] + l[j + w];
+    }
+    double s = l[0];
+    for (; i < n; i++) s += a[i];
+    return s;
+}
+
+/* Is any of the n values 0, for the "Inf" check before dividing */
+inline bool vec_any_zero(Operand a, int n) {
+    if (a.scalar) return *a.data == 0;
+    int i = 0;
+    for (; i + pack_width <= n; i += pack_width) {
+        if (pack_any_zero(pack_load(a.data + i))) return true;
+    }
+    for (; i < n; i++) {
+        if (a.data[i] == 0) return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+
+// This section contains the trigonometric kernels in degrees, for sind, cosd, tand and cotd
+
+/* pi / 180 = deg_hi + deg_lo, and deg_hi = deg_hi1 + deg_hi2 split in halves for exact products */
+const double deg_hi = 0x1.1df46a2529d39p-6, deg_lo = 0x1.5c1d8becdd291p-62;
+const double deg_hi1 = 0x1.1df46ap-6, deg_hi2 = 0x1.294e9c8p-33;
+constexpr double deg_limit = 1e15;  // larger arguments are reduced with fmod() first
+
+/* Nearest integer, by additions only, for |x| < 2^51 */
+inline Pack pack_round(Pack x) {
+    Pack magic = pack_set1(0x1.8p52);
+    return pack_sub(pack_add(x, magic), magic);
+}
+
+/* sin and cos of x degrees for |x| < deg_limit, within 1 ulp. x = 90 q + y exactly with
+   |y| <= 45, so multiples of 90 give exact zeros and ones; y is turned into radians as
+   the unevaluated sum zh + zl, and the polynomials of fdlibm finish the job. Only
+   additions and multiplications, the quadrant is chosen arithmetically too. */
+inline void pack_sincos_deg(Pack x, Pack &s, Pack &c) {
+    Pack one = pack_set1(1), half = pack_set1(0.5);
+    Pack q = pack_round(pack_mul(x, pack_set1(1.0 / 90)));
+    Pack y = pack_sub(x, pack_mul(q, pack_set1(90)));
+
+    Pack t = pack_mul(y, pack_set1(134217729.0));  // Dekker's product y * deg_hi = zh + error
+    Pack y1 = pack_sub(t, pack_sub(t, y)), y2 = pack_sub(y, y1);
+    Pack h1 = pack_set1(deg_hi1), h2 = pack_set1(deg_hi2);
+    Pack zh = pack_mul(y, pack_set1(deg_hi));
+    Pack zl = pack_add(pack_sub(pack_mul(y1, h1), zh), pack_mul(y1, h2));
+    zl = pack_add(pack_add(pack_add(zl, pack_mul(y2, h1)), pack_mul(y2, h2)), pack_mul(y, pack_set1(deg_lo)));
+
+    Pack z = pack_mul(zh, zh), w = pack_mul(z, z), v = pack_mul(z, zh);
+    Pack rs = pack_add(pack_add(pack_set1(8.33333333332248946124e-03), pack_mul(z, pack_add(pack_set1(-1.98412698298579493134e-04), pack_mul(z, pack_set1(2.75573137070700676789e-06))))),
+                       pack_mul(pack_mul(z, w), pack_add(pack_set1(-2.50507602534068634195e-08), pack_mul(z, pack_set1(1.58969099521155010221e-10)))));
+    Pack sin0 = pack_sub(zh, pack_sub(pack_sub(pack_mul(z, pack_sub(pack_mul(half, zl), pack_mul(v, rs))), zl), pack_mul(v, pack_set1(-1.66666666666666324348e-01))));
+    Pack rc = pack_add(pack_mul(z, pack_add(pack_set1(4.16666666666666019037e-02), pack_mul(z, pack_add(pack_set1(-1.38888888888741095749e-03), pack_mul(z, pack_set1(2.48015872894767294178e-05)))))),
+                       pack_mul(pack_mul(w, w), pack_add(pack_set1(-2.75573143513906633035e-07), pack_mul(z, pack_add(pack_set1(2.08757232129817482790e-09), pack_mul(z, pack_set1(-1.13596475577881948265e-11)))))));
+    Pack hz = pack_mul(half, z), r = pack_sub(one, hz);
+    Pack cos0 = pack_add(r, pack_add(pack_sub(pack_sub(one, r), hz), pack_sub(pack_mul(z, rc), pack_mul(zh, zl))));
+
+    Pack n = pack_sub(q, pack_mul(pack_set1(4), pack_round(pack_sub(pack_mul(q, pack_set1(0.25)), pack_set1(0.375)))));  // q mod 4
+    Pack upper = pack_round(pack_sub(pack_mul(n, half), pack_set1(0.25)));  // n is 2 or 3
+    Pack odd = pack_sub(n, pack_mul(pack_set1(2), upper));                  // n is 1 or 3
+    Pack even = pack_sub(one, odd);
+    Pack flip = pack_sub(pack_add(upper, odd), pack_mul(pack_set1(2), pack_mul(upper, odd)));  // upper xor odd
+    Pack zero = pack_set1(0);  // adding it turns -0 into 0
+    s = pack_add(pack_mul(pack_sub(one, pack_add(upper, upper)), pack_add(pack_mul(even, sin0), pack_mul(odd, cos0))), zero);
+    c = pack_add(pack_mul(pack_sub(one, pack_add(flip, flip)), pack_add(pack_mul(even, cos0), pack_mul(odd, sin0))), zero);
+}
+
+/* sin and cos of x degrees, for any x */
+inline void sincos_deg(double x, double &s, double &c) {
+    if (!(std::abs(x) < deg_limit)) x = std::fmod(x, 360.0);  // exact, and nan for inf
+    Pack ps, pc;
+    pack_sincos_deg(pack_set1(x), ps, pc);
+    double sv[pack_width], cv[pack_width];
+    pack_store(sv, ps);
+    pack_store(cv, pc);
+    s = sv[0];
+    c = cv[0];
+}
+
+/* sind (0), cosd (1), tand (2) or cotd (3) of x */
+inline double trig_deg(double x, int which, bool &finite) {
+    double s, c;
+    sincos_deg(x, s, c);
+    if (which < 2) return which == 0 ? s : c;
+    double den = which == 2 ? c : s;
+    finite = finite && den != 0;
+    return (which == 2 ? s : c) / den;
+}
+
+/* trig_deg() of every element, out may be a. False when a tangent or cotangent divides by 0. */
+inline bool vec_trig_deg(const double *a, double *out, int n, int which) {
+    bool finite = true;
+    int i = 0;
+    for (; i + pack_width <= n; i += pack_width) {
+        bool small = true;
+        for (int j = 0; j < pack_width; j++) small = small && std::abs(a[i + j]) < deg_limit;
+        if (!small) {  // large arguments, and nan, one by one
+            for (int j = 0; j < pack_width; j++) out[i + j] = trig_deg(a[i + j], which, finite);
+            continue;
+        }
+        Pack s, c;
+        pack_sincos_deg(pack_load(a + i), s, c);
+        if (which < 2) {
+            pack_store(out + i, which == 0 ? s : c);
+            continue;
+        }
+        Pack den = which == 2 ? c : s;
+        finite = finite && !pack_any_zero(den);
+        pack_store(out + i, pack_div(which == 2 ? s : c, den));
+    }
+    for (; i < n; i++) out[i] = trig_deg(a[i], which, finite);
+    return finite;
+}
+
+#endif
@@ -0,0 +1,261 @@
+/*
+Counters and timing histograms for the hot paths of calculator.h, reported by #stats
+
+Every thread counts into a block of its own, so counting is a plain increment of a
+cache line no other thread writes; a report adds the blocks of all threads up. Objects
+that count many calls, a Token_stream or a Compiler, keep a Stats_batch and add it to
+the block once, when they go. Blocks of finished threads are handed to the next new
+thread, so threads started for every reduction do not pile up blocks. Counts are exact;
+the histograms of the kinds that take nanoseconds are a sample, one call in
+timing_period reads the clock, and a kind with no timed call yet shows - for its times.
+
+Build with -DCALCULATOR_STATS=0 and the STATS_ macros expand to nothing.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifndef CALCULATOR_STATS
+#define CALCULATOR_STATS 1
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+/* What is counted; the kinds up to timed_stats are also timed */
+enum class Stat : unsigned char
+{
+    lex,             // Token_stream::read(), one Token
+    statement,       // the Compiler grammar levels, each including the levels below it
+    expression,
+    term,
+    primary,
+    evaluate,        // evaluate() of a number statement
+    evaluate_array,  // evaluate_array()
+    reduce,          // reduce(), all of its threads
+    lookup,          // Symbol_table::intern() and find()
+    lookup_miss,     // names not in the table yet
+    error,           // exceptions thrown by error()
+};
+
+const int timed_stats = int(Stat::reduce) + 1;
+const int all_stats = int(Stat::error) + 1;
+const int stats_builtins = 64;   // at least the size of builtins[] in calculator.h
+
+/* One call in timing_period[kind] is timed, a power of 2; statements and whole evaluations over arrays take long enough to time all */
+constexpr unsigned timing_period[timed_stats] = {64, 1, 64, 64, 64, 64, 1, 1};
+
+/* Bucket of a duration in ns: exact below 8, then 4 buckets per power of 2 up to about 18 minutes */
+const int time_buckets = 8 + 38 * 4;
+
+inline int time_bucket(uint64_t ns) {
+    if (ns < 8) return int(ns);
+    int shift = 63 - __builtin_clzll(ns) - 2;  // leaves ns >> shift between 4 and 7
+    return std::min(8 + (shift - 1) * 4 + int(ns >> shift) - 4, time_buckets - 1);
+}
+
+/* Lowest duration of a bucket */
+inline uint64_t bucket_floor(int i) {
+    if (i < 8) return uint64_t(i);
+    int shift = (i - 8) / 4 + 1;
+    return uint64_t((i - 8) % 4 + 4) << shift;
+}
+
+//------------------------------------------------------------------------------
+
+// This section keeps the counts of one thread
+
+/* Written by its thread only, read by reports at any time, hence relaxed atomics */
+struct Stats_block
+{
+    std::atomic<uint64_t> calls[all_stats] {};
+    std::atomic<uint64_t> builtin_calls[stats_builtins] {};
+    std::atomic<uint64_t> time[timed_stats][time_buckets] {};
+    std::atomic<uint64_t> time_total[timed_stats] {};  // ns of the timed calls
+};
+
+inline uint64_t bump(std::atomic<uint64_t> &c, uint64_t by = 1) {
+    uint64_t v = c.load(std::memory_order_relaxed) + by;  // one writer, no locked instruction needed
+    c.store(v, std::memory_order_relaxed);
+    return v;
+}
+
+inline std::mutex stats_m;
+inline std::vector<Stats_block *> stats_blocks;  // every block ever made, guarded by stats_m
+inline std::vector<Stats_block *> stats_free;    // blocks of threads that have finished
+inline thread_local Stats_block *stats_mine = nullptr;
+
+/* Gives the block back when its thread ends */
+struct Stats_owner
+{
+    Stats_block *block {nullptr};
+    ~Stats_owner() {
+        std::lock_guard<std::mutex> lock(stats_m);
+        if (block) stats_free.push_back(block);
+        stats_mine = nullptr;
+    }
+};
+
+inline Stats_block &claim_stats() {
+    thread_local Stats_owner owner;
+    std::lock_guard<std::mutex> lock(stats_m);
+    if (stats_free.empty()) {
+        stats_blocks.push_back(new Stats_block);  // kept to the end, its counts are part of every report
+        stats_free.push_back(stats_blocks.back());
+    }
+    owner.block = stats_free.back();
+    stats_free.pop_back();
+    return *(stats_mine = owner.block);
+}
+
+inline Stats_block &local_stats() {
+    return stats_mine ? *stats_mine : claim_stats();
+}
+
+inline void count_stat(Stat s) { bump(local_stats().calls[int(s)]); }
+
+inline void count_builtin(int index) {
+    if (index >= 0 && index < stats_builtins) bump(local_stats().builtin_calls[index]);
+}
+
+/* Counts of one object, added to the block of its thread by the destructor. Sampling starts
+   at a phase taken from the thread's count of Tokens, so short-lived objects get timed too. */
+struct Stats_batch
+{
+#if CALCULATOR_STATS
+    Stats_block &b;
+    uint64_t calls[timed_stats] {};
+    uint64_t phase;
+
+    Stats_batch(): b(local_stats()), phase(b.calls[int(Stat::lex)].load(std::memory_order_relaxed)) {}
+    ~Stats_batch() {
+        for (int i = 0; i < timed_stats; i++) {
+            if (calls[i]) bump(b.calls[i], calls[i]);
+        }
+    }
+    Stats_batch(const Stats_batch &) = delete;
+    Stats_batch &operator=(const Stats_batch &) = delete;
+#endif
+};
+
+/* Counts a call while in scope, and times one in timing_period[s] */
+class Stats_timer
+{
+    private:
+        Stats_block &b;
+        int kind;
+        bool timed;
+        std::chrono::steady_clock::time_point start;
+
+        void begin(uint64_t n) {
+            timed = (n & (timing_period[kind] - 1)) == 0;
+            if (timed) start = std::chrono::steady_clock::now();
+        }
+    public:
+        explicit Stats_timer(Stat s): b(local_stats()), kind(int(s)) { begin(bump(b.calls[kind])); }
+#if CALCULATOR_STATS
+        Stats_timer(Stat s, Stats_batch &batch): b(batch.b), kind(int(s)) { begin(batch.phase + ++batch.calls[kind]); }
+#endif
+        ~Stats_timer() {
+            if (!timed) return;
+            auto ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            bump(b.time[kind][time_bucket(ns)]);
+            bump(b.time_total[kind], ns);
+        }
+        Stats_timer(const Stats_timer &) = delete;
+        Stats_timer &operator=(const Stats_timer &) = delete;
+};
+
+#if CALCULATOR_STATS
+#define STATS_CONCAT2(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT2(a, b)
+#define STATS_COUNT(kind) count_stat(kind)
+#define STATS_BUILTIN(index) count_builtin(index)
+#define STATS_TIME(kind) Stats_timer STATS_CONCAT(stats_timer_, __LINE__)(kind)
+#define STATS_TIME_IN(batch, kind) Stats_timer STATS_CONCAT(stats_timer_, __LINE__)(kind, batch)
+#else
+#define STATS_COUNT(kind) ((void)0)
+#define STATS_BUILTIN(index) ((void)0)
+#define STATS_TIME(kind) ((void)0)
+#define STATS_TIME_IN(batch, kind) ((void)0)
+#endif
+
+//------------------------------------------------------------------------------
+
+// This section reports the counts of all threads
+
+/* Every count set to 0, counts made while this runs may survive */
+inline void reset_stats() {
+    std::lock_guard<std::mutex> lock(stats_m);
+    for (Stats_block *b : stats_blocks) {
+        for (auto &c : b->calls) c.store(0, std::memory_order_relaxed);
+        for (auto &c : b->builtin_calls) c.store(0, std::memory_order_relaxed);
+        for (auto &row : b->time) {
+            for (auto &c : row) c.store(0, std::memory_order_relaxed);
+        }
+        for (auto &c : b->time_total) c.store(0, std::memory_order_relaxed);
+    }
+}
+
+/* A table of the counts, with mean and percentiles of the timed kinds; builtin_names
+   gives the name of every builtin position */
+inline void print_stats(std::ostream &os, const std::vector<std::string_view> &builtin_names) {
+    static const char *names[all_stats] = {"lex", "statement", "expression", "term", "primary", "evaluate", "evaluate_array", "reduce", "lookup", "lookup_miss", "error"};
+    uint64_t calls[all_stats] {}, builtin_calls[stats_builtins] {}, time[timed_stats][time_buckets] {}, time_total[timed_stats] {};
+    {
+        std::lock_guard<std::mutex> lock(stats_m);
+        for (const Stats_block *b : stats_blocks) {
+            for (int i = 0; i < all_stats; i++) calls[i] += b->calls[i].load(std::memory_order_relaxed);
+            for (int i = 0; i < stats_builtins; i++) builtin_calls[i] += b->builtin_calls[i].load(std::memory_order_relaxed);
+            for (int i = 0; i < timed_stats; i++) {
+                for (int j = 0; j < time_buckets; j++) time[i][j] += b->time[i][j].load(std::memory_order_relaxed);
+                time_total[i] += b->time_total[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    char line[160];
+    snprintf(line, sizeof line, "%-16s %12s %10s %10s %10s %12s\n", "", "calls", "mean ns", "p50 ns", "p99 ns", "total ms");
+    os << line;
+    for (int i = 0; i < all_stats; i++) {
+        if (i >= timed_stats) {
+            snprintf(line, sizeof line, "%-16s %12llu\n", names[i], (unsigned long long)calls[i]);
+            os << line;
+            continue;
+        }
+        uint64_t sampled = 0;
+        for (uint64_t c : time[i]) sampled += c;
+        if (sampled == 0) {  // too few calls to have timed one, and 0 would claim they cost nothing
+            snprintf(line, sizeof line, "%-16s %12llu %10s %10s %10s %12s\n", names[i], (unsigned long long)calls[i], "-", "-", "-", "-");
+            os << line;
+            continue;
+        }
+        auto percentile = [&](double q) {
+            uint64_t rank = std::max(uint64_t(q * sampled + 0.5), uint64_t(1)), seen = 0;
+            for (int j = 0; j < time_buckets; j++) {
+                if ((seen += time[i][j]) >= rank) return bucket_floor(j);
+            }
+            return uint64_t(0);
+        };
+        double mean = double(time_total[i]) / sampled;
+        snprintf(line, sizeof line, "%-16s %12llu %10.0f %10llu %10llu %12.3f\n", names[i], (unsigned long long)calls[i], mean,
+                 (unsigned long long)percentile(0.5), (unsigned long long)percentile(0.99), mean * calls[i] / 1e6);
+        os << line;
+    }
+    bool any = false;
+    for (size_t i = 0; i < builtin_names.size() && i < size_t(stats_builtins); i++) {
+        if (!builtin_calls[i]) continue;
+        os << (any ? ", " : "builtins: ") << builtin_names[i] << ' ' << builtin_calls[i];
+        any = true;
+    }
+    if (any) os << '\n';
+}
+
+#endif
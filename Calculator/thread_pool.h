@@ -0,0 +1,110 @@
+/*
+Work-stealing thread pool used by the parallel batch mode
+
+Every worker owns a queue. New tasks are dealt round-robin onto the queues; a
+worker takes from the front of its own queue and, when that is empty, steals from
+the back of the others, so a few slow tasks do not leave the other cores idle.
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Thread_pool
+{
+    private:
+        struct Queue
+        {
+            std::mutex m;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> threads;
+        std::mutex idle_m;
+        std::condition_variable idle_cv;
+        int queued {0};        // tasks waiting in any queue, guarded by idle_m
+        bool stopping {false};
+        std::atomic<unsigned> next {0};  // queue for the next submit()
+
+        bool take(size_t self, std::function<void()> &task);
+        void work(size_t self);
+    public:
+        explicit Thread_pool(unsigned n = std::thread::hardware_concurrency());
+        ~Thread_pool();
+        void submit(std::function<void()> task);
+        size_t size() const { return threads.size(); }
+};
+
+inline Thread_pool::Thread_pool(unsigned n) {
+    if (n == 0) n = 1;
+    for (unsigned i = 0; i < n; i++) queues.push_back(std::make_unique<Queue>());
+    for (unsigned i = 0; i < n; i++) threads.emplace_back(&Thread_pool::work, this, i);
+}
+
+/* Runs the tasks still queued, then joins the workers */
+inline Thread_pool::~Thread_pool() {
+    {
+        std::lock_guard<std::mutex> lock(idle_m);
+        stopping = true;
+    }
+    idle_cv.notify_all();
+    for (std::thread &t : threads) t.join();
+}
+
+inline void Thread_pool::submit(std::function<void()> task) {
+    Queue &q = *queues[next++ % queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(q.m);
+        q.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(idle_m);
+        queued++;
+    }
+    idle_cv.notify_one();
+}
+
+/* Front of our own queue, otherwise the back of someone else's */
+inline bool Thread_pool::take(size_t self, std::function<void()> &task) {
+    for (size_t i = 0; i < queues.size(); i++) {
+        Queue &q = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(q.m);
+        if (q.tasks.empty()) continue;
+        if (i == 0) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        else {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+inline void Thread_pool::work(size_t self) {
+    std::function<void()> task;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(idle_m);
+            idle_cv.wait(lock, [this] { return queued > 0 || stopping; });
+            if (queued == 0) return;  // stopping and nothing left
+            queued--;  // claim one task, there is a task in some queue for every claim
+        }
+        while (!take(self, task)) std::this_thread::yield();  // someone took ours, theirs is in a queue we passed
+        task();
+        task = nullptr;
+    }
+}
+
+#endif
@@ -1,52 +1,245 @@
 #include <linux/input.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
 #include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <exception>
-#include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
-#include <regex>
+#include <memory>
+#include <queue>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 using namespace std::chrono;
 
-typedef std::map<int, std::string> MouseDeviceMap;
+// One entry of /proc/bus/input/devices
+struct InputDevice
+{
+   unsigned bus = 0, vendor = 0, product = 0, version = 0;
+   std::string name;
+   std::string phys;
+   std::vector<std::string> handlers;
+   int event = -1;          // N of the eventN handler
+   int mouse = -1;          // N of the mouseN handler
+   // Capability bitmaps as the kernel prints them, bit n in word n / bits_per_word
+   std::vector<unsigned long> ev, key, rel, abs;
+
+   static const int bits_per_word = 8 * sizeof(unsigned long);
+
+   bool isMouse() const { return event >= 0 && mouse >= 0; }
+   static bool has(const std::vector<unsigned long> &bits, int n)
+   {
+      return size_t(n / bits_per_word) < bits.size() && (bits[n / bits_per_word] >> (n % bits_per_word) & 1) != 0;
+   }
+};
 
+typedef std::map<int, InputDevice> MouseDeviceMap;  // by the N of /dev/input/eventN
 
-// Get the list of mouse devices from /proc/bus/input/devices
+// The digits at the start of text in the given base, and how many there were
 static
-MouseDeviceMap
-getMouseDevices()
+unsigned long
+parseNumber(std::string_view text, int base, size_t *length = nullptr)
 {
-   MouseDeviceMap devices;
+   unsigned long value = 0;
+   size_t i = 0;
+   for (; i < text.size(); ++i)
+   {
+      char c = text[i];
+      int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : base;
+      if (digit >= base)
+      {
+         break;
+      }
+      value = value * base + digit;
+   }
+   if (length)
+   {
+      *length = i;
+   }
+   return value;
+}
+
+// The words of text separated by blanks, in turn
+static
+bool
+nextWord(std::string_view &text, std::string_view &word)
+{
+   size_t start = text.find_first_not_of(" \t");
+   if (start == std::string_view::npos)
+   {
+      return false;
+   }
+   size_t end = std::min(text.find_first_of(" \t", start), text.size());
+   word = text.substr(start, end - start);
+   text.remove_prefix(end);
+   return true;
+}
+
+// The N of a word such as "event12" that starts with prefix, or -1
+static
+int
+handlerNumber(std::string_view word, std::string_view prefix)
+{
+   if (word.size() <= prefix.size() || word.substr(0, prefix.size()) != prefix)
+   {
+      return -1;
+   }
+   size_t length;
+   unsigned long n = parseNumber(word.substr(prefix.size()), 10, &length);
+   return length == word.size() - prefix.size() ? int(n) : -1;
+}
 
-   std::regex device_name_re("^N: Name=\"(.*)\"");
-   std::regex mouse_event_re("^H: Handlers=mouse\\d.*event(\\d+)\\s*");
-   std::regex blank_line_re("^\\s*$");
-   std::ifstream dev_f("/proc/bus/input/devices");
-   std::string line;
-   std::string device_name;
-   while (std::getline(dev_f, line))
+// Every device of the text of /proc/bus/input/devices: one block of "X: ..." lines each,
+// separated by blank lines. One pass, no regular expressions.
+static
+std::vector<InputDevice>
+parseInputDevices(std::string_view text)
+{
+   std::vector<InputDevice> devices;
+   InputDevice device;
+   bool any = false;
+   while (!text.empty())
    {
-      std::smatch match_result;
-      if (std::regex_match(line, match_result, device_name_re))
+      size_t end = std::min(text.find('\n'), text.size());
+      std::string_view line = text.substr(0, end);
+      text.remove_prefix(std::min(end + 1, text.size()));
+      if (line.find_first_not_of(" \t\r") == std::string_view::npos)
+      {
+         if (any)
+         {
+            devices.push_back(std::move(device));
+            device = InputDevice();
+            any = false;
+         }
+         continue;
+      }
+      if (line.size() < 3 || line[1] != ':')
+      {
+         continue;
+      }
+      any = true;
+      char kind = line[0];
+      std::string_view rest = line.substr(3);
+      std::string_view word;
+      if (kind == 'N' && rest.substr(0, 6) == "Name=\"")
+      {
+         size_t close = rest.rfind('"');
+         device.name = std::string(rest.substr(6, close > 6 ? close - 6 : 0));
+      }
+      else if (kind == 'P' && rest.substr(0, 5) == "Phys=")
+      {
+         device.phys = std::string(rest.substr(5));
+      }
+      else if (kind == 'I')
       {
-         device_name = match_result[1];
+         while (nextWord(rest, word))
+         {
+            size_t equals = word.find('=');
+            std::string_view key = word.substr(0, equals);
+            unsigned value = equals == std::string_view::npos ? 0 : parseNumber(word.substr(equals + 1), 16);
+            (key == "Bus" ? device.bus : key == "Vendor" ? device.vendor : key == "Product" ? device.product : device.version) = value;
+         }
       }
-      else if (std::regex_match(line, match_result, mouse_event_re))
+      else if (kind == 'H' && rest.substr(0, 9) == "Handlers=")
       {
-         if (!device_name.empty())
+         rest.remove_prefix(9);
+         while (nextWord(rest, word))
          {
-            devices[stoi(match_result[1])] = device_name;
+            device.handlers.emplace_back(word);
+            int n;
+            if ((n = handlerNumber(word, "event")) >= 0)
+            {
+               device.event = n;
+            }
+            else if ((n = handlerNumber(word, "mouse")) >= 0)
+            {
+               device.mouse = n;
+            }
          }
-         device_name.clear();
       }
-      else if (std::regex_match(line, match_result, blank_line_re))
+      else if (kind == 'B')
       {
-         device_name.clear();
+         // Words of hex, the most significant first
+         size_t equals = rest.find('=');
+         std::string_view key = rest.substr(0, equals);
+         std::vector<unsigned long> *bits = key == "EV" ? &device.ev : key == "KEY" ? &device.key
+                                          : key == "REL" ? &device.rel : key == "ABS" ? &device.abs : nullptr;
+         if (bits && equals != std::string_view::npos)
+         {
+            rest.remove_prefix(equals + 1);
+            while (nextWord(rest, word))
+            {
+               bits->push_back(parseNumber(word, 16));
+            }
+            std::reverse(bits->begin(), bits->end());
+         }
       }
    }
+   if (any)
+   {
+      devices.push_back(std::move(device));
+   }
+   return devices;
+}
+
+// The whole of a file that may not know its size, as files of /proc do not
+static
+std::string
+readWholeFile(const std::string &path)
+{
+   std::string text;
+   int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+   {
+      return text;
+   }
+   char buffer[16384];
+   ssize_t n;
+   while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+   {
+      text.append(buffer, std::max(n, ssize_t(0)));
+   }
+   close(fd);
+   return text;
+}
 
+// Get the list of mouse devices from /proc/bus/input/devices, or a file like it
+static
+MouseDeviceMap
+getMouseDevices(const std::string &path = "/proc/bus/input/devices")
+{
+   MouseDeviceMap devices;
+   for (InputDevice &device: parseInputDevices(readWholeFile(path)))
+   {
+      if (device.isMouse())
+      {
+         int event = device.event;
+         devices[event] = std::move(device);
+      }
+   }
    return devices;
 }
 
@@ -54,9 +247,11 @@ static
 std::ostream &
 printMouseDevices(std::ostream &os, const MouseDeviceMap &devices)
 {
-   for (auto device: devices)
+   for (auto &device: devices)
    {
-      os << "\t" << device.first << "\t" << device.second << std::endl;
+      char id[16];
+      snprintf(id, sizeof id, "%04x:%04x", device.second.vendor, device.second.product);
+      os << "\t" << device.first << "\t" << id << "\t" << device.second.name << std::endl;
    }
    return os;
 }
@@ -66,95 +261,1835 @@ void
 usage(const std::string &app_name, const MouseDeviceMap &devices)
 {
    printMouseDevices(
-           std::cout << "Usage:\n\t" << app_name << " device_number\n\n"
+           std::cout << "Usage:\n\t" << app_name << " device_number...\n"
+           << "\t" << app_name << " --all\n"
+           << "\t" << app_name << " --input file...\n"
+           << "\t" << app_name << " --replay capture [--realtime]\n\n"
            << "where \"device_number\" is one of:\n\n", devices)
+           << "\n\"file\" is read instead of a device, such as a FIFO or a saved event stream.\n"
+           << "Several devices and files are merged into one stream in time order, each line tagged with dev=N.\n"
+           << "--record capture writes every event to a binary capture file instead of text, which\n"
+           << "--replay reads back through the same processing, at full speed or at the recorded pace.\n"
+           << "A thread of its own reads the devices; --cpu N pins it to CPU N and --fifo priority\n"
+           << "runs it with SCHED_FIFO at that priority, 1 to 99, which needs CAP_SYS_NICE.\n"
+           << "The report intervals, polling rate, interval percentiles and the latency from the kernel\n"
+           << "to read() of each device go to stderr at the end, and every s seconds with --summary s.\n"
+           << "A mouse unplugged is read again when it comes back; with --all, new mice are added.\n"
+           << "--proc-devices file and --input-dir dir stand in for /proc/bus/input/devices and /dev/input.\n"
            << std::endl;
 }
 
-int
-main(int argc, char *argv[])
+
+// Set by SIGINT and SIGTERM so that the capture loop stops and flushes its output
+static volatile sig_atomic_t stop_capture = 0;
+
+static
+void
+onStopSignal(int)
 {
-   std::string device_number;
-   auto devices = getMouseDevices();
+   stop_capture = 1;
+}
 
-   for (int i = 1; i < argc; ++i)
+
+// Whole input_events read in large batches from a device, a file or a FIFO
+class EventReader
+{
+public:
+   explicit EventReader(int fd) : fd_(fd) {}
+
+   // Read the next batch: the number of events, 0 at the end of the input, -1 on error
+   ssize_t read();
+   const struct input_event *events() const { return events_; }
+
+   static const size_t capacity = 512;
+
+private:
+   int fd_;
+   struct input_event events_[capacity];
+   size_t filled_ = 0;    // bytes in events_
+   size_t consumed_ = 0;  // bytes handed out by the last read(), the rest is part of an event
+};
+
+ssize_t
+EventReader::read()
+{
+   // An event device returns whole events, files and FIFOs may cut one in two
+   char *bytes = reinterpret_cast<char *>(events_);
+   memmove(bytes, bytes + consumed_, filled_ - consumed_);
+   filled_ -= consumed_;
+   consumed_ = 0;
+
+   while (true)
    {
-      if (device_number.empty())
+      ssize_t n = ::read(fd_, bytes + filled_, sizeof(events_) - filled_);
+      if (n <= 0)
       {
-         device_number = argv[i];
+         return n;
       }
-      else
+      filled_ += n;
+      size_t count = filled_ / sizeof(struct input_event);
+      if (count > 0)
       {
-         usage(*argv, devices);
-         return 1;
+         consumed_ = count * sizeof(struct input_event);
+         return count;
       }
+      // only part of an event so far, which is not the end of the input
    }
+}
+
+
+// Text collected in a large buffer and written with few write() calls
+class OutputBuffer
+{
+public:
+   explicit OutputBuffer(int fd, size_t capacity = 1 << 20) : fd_(fd), buffer_(capacity) {}
+   ~OutputBuffer() { flush(); }
+
+   // Space for at least n more bytes, to be followed by commit()
+   char *reserve(size_t n);
+   void commit(size_t n) { used_ += n; }
+   void flush();
+   bool empty() const { return used_ == 0; }
 
-   if (device_number.empty())
+private:
+   int fd_;
+   std::vector<char> buffer_;
+   size_t used_ = 0;
+};
+
+char *
+OutputBuffer::reserve(size_t n)
+{
+   if (used_ + n > buffer_.size())
    {
-      usage(*argv, devices);
-      return 0;
+      flush();
    }
+   return buffer_.data() + used_;
+}
 
-   // choose mouse device
-   MouseDeviceMap::const_iterator device = devices.end();
-   try
+void
+OutputBuffer::flush()
+{
+   for (size_t done = 0; done < used_; )
    {
-      device = devices.find(stoi(device_number));
-      if (device == devices.end())
+      ssize_t n = ::write(fd_, buffer_.data() + done, used_ - done);
+      if (n < 0 && errno == EINTR)
       {
-         printMouseDevices(
-                 std::cout << "No such device \"" << device_number << "\".\n"
-                 << "please choose one of:\n\n", devices)
-                 << std::endl;
-         return 0;
+         continue;
+      }
+      if (n <= 0)
+      {
+         break;  // nobody is reading any more, the output is lost
       }
+      done += n;
    }
-   catch (const std::invalid_argument &e)
+   used_ = 0;
+}
+
+
+// Binary capture files: a CaptureHeader, a CaptureDevice for each input, then one
+// CaptureRecord for every event read, in the order they were read. All little-endian,
+// as written by the machine that captured.
+struct CaptureHeader
+{
+   char magic[8];       // "MOUSECAP"
+   uint32_t version;    // capture_version
+   uint32_t clock;      // CLOCK_REALTIME or CLOCK_MONOTONIC, what the event times are measured by
+   int64_t start_ns;    // time of the start of the capture, by the same clock
+   uint32_t devices;    // CaptureDevice entries that follow
+   uint32_t record_size;
+};
+
+struct CaptureDevice
+{
+   int32_t number;      // N of /dev/input/eventN, or the position among the --input files
+   char name[124];      // NUL-terminated, cut short if need be
+};
+
+struct CaptureRecord
+{
+   int64_t time_ns;
+   int32_t value;
+   uint16_t code;
+   uint8_t type;
+   uint8_t device;      // index of the CaptureDevice
+};
+
+static const char capture_magic[8] = {'M', 'O', 'U', 'S', 'E', 'C', 'A', 'P'};
+static const uint32_t capture_version = 1;
+static const size_t max_capture_devices = 256;
+
+static_assert(sizeof(CaptureHeader) == 32 && sizeof(CaptureDevice) == 128 && sizeof(CaptureRecord) == 16,
+              "the capture format must not depend on the compiler");
+
+
+// Mean and variance of a stream by Welford's method, so that long streams lose no precision.
+// Two of them merge by Chan's method.
+class RunningStats
+{
+public:
+   void add(double x);
+   void merge(const RunningStats &other);
+
+   unsigned long count() const { return n_; }
+   double mean() const { return mean_; }
+   // Of the population, as the passes of exclude3std.m compute it
+   double stddev() const { return n_ > 0 ? std::sqrt(m2_ / n_) : 0.0; }
+   // Of a sample, divided by N - 1 as MATLAB's std() that exclude3std.m starts with
+   double sampleStddev() const { return n_ > 1 ? std::sqrt(m2_ / (n_ - 1)) : 0.0; }
+
+private:
+   unsigned long n_ = 0;
+   double mean_ = 0.0;
+   double m2_ = 0.0;   // sum of squared differences from the mean
+};
+
+void
+RunningStats::add(double x)
+{
+   n_++;
+   double delta = x - mean_;
+   mean_ += delta / n_;
+   m2_ += delta * (x - mean_);
+}
+
+void
+RunningStats::merge(const RunningStats &other)
+{
+   if (other.n_ == 0)
    {
-      printMouseDevices(
-              std::cout << "No such device \"" << device_number << "\".\n"
-              << "please choose one of:\n\n", devices)
-              << std::endl;
-      return 1;
+      return;
    }
+   unsigned long n = n_ + other.n_;
+   double delta = other.mean_ - mean_;
+   mean_ += delta * other.n_ / n;
+   m2_ += other.m2_ + delta * delta * (double(n_) * other.n_ / n);
+   n_ = n;
+}
+
+// exclude3std.m on a stream: every block_size intervals go through three passes, each
+// dropping those more than 3 standard deviations from the mean of the pass before, and
+// what is left joins the total. The memory is one block however long the capture.
+class IntervalStats
+{
+public:
+   explicit IntervalStats(size_t block_size = 4096) : block_size_(block_size) { block_.reserve(block_size); }
 
-   std::cout << "\nUsing mouse device \"" << device->second << "\"" << std::endl;
+   void add(double interval);
+   // Every interval so far
+   const RunningStats &all() const { return all_; }
+   // Those that pass the rejection, the unfinished block included
+   RunningStats kept() const;
 
+private:
+   static RunningStats reject(const std::vector<double> &block);
 
-   // Read and report `the events from the mouse input device.
-   auto mouse_filename = std::string("/dev/input/event") + device_number;
-   auto t0 = system_clock::now();
-   long x = 0L, y = 0L, dx = 0L, dy = 0L;
-   struct input_event event;
-   std::ifstream device_file(mouse_filename.c_str(), std::ios::in);
-   while (device_file.read(reinterpret_cast<char*>(&event), sizeof(event)))
+   size_t block_size_;
+   std::vector<double> block_;
+   RunningStats all_;
+   RunningStats kept_;
+};
+
+void
+IntervalStats::add(double interval)
+{
+   all_.add(interval);
+   block_.push_back(interval);
+   if (block_.size() == block_size_)
+   {
+      kept_.merge(reject(block_));
+      block_.clear();
+   }
+}
+
+RunningStats
+IntervalStats::kept() const
+{
+   RunningStats kept = kept_;
+   kept.merge(reject(block_));
+   return kept;
+}
+
+RunningStats
+IntervalStats::reject(const std::vector<double> &block)
+{
+   RunningStats stats;
+   for (double x: block)
+   {
+      stats.add(x);
+   }
+   for (int pass = 0; pass < 3; ++pass)
+   {
+      RunningStats next;
+      double limit = 3 * (pass == 0 ? stats.sampleStddev() : stats.stddev());
+      for (double x: block)
+      {
+         if (std::fabs(x - stats.mean()) <= limit)
+         {
+            next.add(x);
+         }
+      }
+      stats = next;
+   }
+   return stats;
+}
+
+// Counts of durations in ns at 3 significant digits, from 1 ns to about 36 minutes: exact
+// below 2048, then 1024 buckets for every power of 2. All the memory is taken at the start,
+// and one thread records with plain stores to relaxed atomics while others read percentiles.
+class HdrHistogram
+{
+public:
+   HdrHistogram() : counts_(new std::atomic<uint64_t>[buckets]()) {}
+
+   // From the one thread that records
+   void record(int64_t ns);
+
+   uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+   int64_t max() const { return max_.load(std::memory_order_relaxed); }
+   // The highest value of the bucket holding the q quantile, as HDR histograms report it,
+   // but no more than the largest value recorded
+   int64_t percentile(double q) const;
+
+private:
+   static const int sub_bits = 11;
+   static const int half = 1 << (sub_bits - 1);
+   static const int buckets = (40 - sub_bits + 3) * half;
+
+   static int bucket(int64_t ns);
+   static int64_t bucketFloor(int i);
+   static void bump(std::atomic<uint64_t> &c) { c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+   std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+   std::atomic<uint64_t> total_{0};
+   std::atomic<int64_t> max_{0};
+};
+
+int
+HdrHistogram::bucket(int64_t ns)
+{
+   if (ns < 2 * half)
+   {
+      return ns < 0 ? 0 : int(ns);
+   }
+   int shift = 63 - __builtin_clzll(uint64_t(ns)) - (sub_bits - 1);  // leaves ns >> shift between half and 2 * half
+   return std::min(shift * half + int(ns >> shift), buckets - 1);
+}
+
+int64_t
+HdrHistogram::bucketFloor(int i)
+{
+   if (i < 2 * half)
+   {
+      return i;
+   }
+   int shift = i / half - 1;
+   return int64_t(i - shift * half) << shift;
+}
+
+void
+HdrHistogram::record(int64_t ns)
+{
+   bump(counts_[bucket(ns)]);
+   bump(total_);
+   if (ns > max_.load(std::memory_order_relaxed))
+   {
+      max_.store(ns, std::memory_order_relaxed);
+   }
+}
+
+int64_t
+HdrHistogram::percentile(double q) const
+{
+   uint64_t rank = std::max(uint64_t(std::ceil(q * count())), uint64_t(1)), seen = 0;
+   for (int i = 0; i < buckets; ++i)
+   {
+      if ((seen += counts_[i].load(std::memory_order_relaxed)) >= rank)
+      {
+         return i + 1 < buckets ? std::min(bucketFloor(i + 1) - 1, max()) : max();
+      }
+   }
+   return max();
+}
+
+// ReportTime.m and Onlyx.m as the reports arrive: the intervals between reports that moved
+// the mouse, and between those that moved it along x and along y
+struct ReportAnalysis
+{
+   // A SYN_REPORT at time_ns, which moved by dx and dy
+   void report(int64_t time_ns, long dx, long dy);
+
+   IntervalStats any, x, y;
+   HdrHistogram jitter;   // the intervals of any, none rejected, for the tail
+   int64_t last_any = -1, last_x = -1, last_y = -1;
+};
+
+void
+ReportAnalysis::report(int64_t time_ns, long dx, long dy)
+{
+   // Intervals in us, the unit of evdev times; a double holds them exactly
+   if (dx == 0 && dy == 0)
+   {
+      return;
+   }
+   if (last_any >= 0)
+   {
+      any.add((time_ns - last_any) / 1e3);
+      jitter.record(time_ns - last_any);
+   }
+   last_any = time_ns;
+   if (dx != 0)
+   {
+      if (last_x >= 0)
+      {
+         x.add((time_ns - last_x) / 1e3);
+      }
+      last_x = time_ns;
+   }
+   if (dy != 0)
+   {
+      if (last_y >= 0)
+      {
+         y.add((time_ns - last_y) / 1e3);
+      }
+      last_y = time_ns;
+   }
+}
+
+// An input to capture from, with the position of its mouse and what was lost along the way.
+// The thread reading the input and the thread merging its events each have fields of their own.
+struct Device
+{
+   Device(int device_fd, int device_number, const std::string &device_name)
+      : fd(device_fd), number(device_number), name(device_name), reader(device_fd) {}
+
+   int fd;
+   int number;              // N of /dev/input/eventN when first opened, or the position among the --input files
+   std::string name;
+   unsigned vendor = 0, product = 0;
+   clockid_t clock = CLOCK_REALTIME;  // of the event times, CLOCK_MONOTONIC once the device agrees
+
+   // The reader's
+   EventReader reader;
+   int node = -1;           // N of the /dev/input/eventN open now, -1 for a file
+   bool pollable = true;    // false for regular files, which epoll refuses and which are always readable
+   bool live = false;       // a device, which cannot be kept waiting, rather than a file or FIFO
+   bool reading = true;
+   bool told_idle = false;  // the last note to the consumer was that nothing is waiting
+   bool overrun = false;    // events were lost since the last ones the consumer got
+   unsigned long overruns = 0;   // events lost because the consumer was behind
+   HdrHistogram latency;    // from the time the kernel gave an event to the read() of it, devices only
+
+   // The consumer's
+   alignas(64) bool open = true;
+   bool idle = false;       // the last read found nothing waiting
+   steady_clock::time_point idle_since;
+   int64_t last_ns = 0;     // time of the latest event read, the device sends nothing older after it
+   long x = 0L, y = 0L;
+   unsigned long events = 0;     // every event read
+   unsigned long dropped = 0;    // SYN_DROPPED, the kernel buffer overflowed
+   unsigned long discarded = 0;  // events between a SYN_DROPPED and the next SYN_REPORT
+   bool dropping = false;
+   long frame_dx = 0L, frame_dy = 0L;  // motion since the last SYN_REPORT
+   ReportAnalysis analysis;
+};
+
+// The time of an event in ns, by whichever clock the device was told to use
+static inline
+int64_t
+eventNs(const struct input_event &event)
+{
+   return event.time.tv_sec * 1000000000LL + event.time.tv_usec * 1000LL;
+}
+
+// Write v in decimal at p, the end of what was written
+static inline
+char *
+appendDecimal(char *p, int64_t v)
+{
+   uint64_t u = v < 0 ? 0 - uint64_t(v) : uint64_t(v);
+   if (v < 0)
+   {
+      *p++ = '-';
+   }
+   char digits[20];
+   int n = 0;
+   do
+   {
+      digits[n++] = char('0' + u % 10);
+      u /= 10;
+   } while (u != 0);
+   while (n > 0)
+   {
+      *p++ = digits[--n];
+   }
+   return p;
+}
+
+template <size_t N>
+static inline
+char *
+appendText(char *p, const char (&text)[N])
+{
+   memcpy(p, text, N - 1);
+   return p + N - 1;
+}
+
+// A relative motion waiting to be written in time order
+struct Motion
+{
+   int64_t time_ns;
+   unsigned long sequence;  // keeps the order of events with the same time
+   int device;              // index in the device list
+   unsigned short code;
+   int value;
+
+   bool operator>(const Motion &m) const
+   {
+      return time_ns != m.time_ns ? time_ns > m.time_ns : sequence > m.sequence;
+   }
+};
+
+// Merges the events of all devices into one stream ordered by event time. A motion is
+// written once no device can still send an older one: every other device has sent
+// something as recent, or has had nothing to read for the whole window.
+class Capture
+{
+public:
+   // Motions are written as text, with times from the first of them, or when record is given,
+   // every event goes there instead
+   explicit Capture(std::vector<std::unique_ptr<Device>> &devices, OutputBuffer *record = nullptr)
+      : devices_(devices), out_(STDOUT_FILENO), record_(record) {}
+
+   // Account for a batch of events of device d
+   void add(int d, const struct input_event *events, ssize_t count);
+   // Write the motions that can no longer be overtaken, all of them when flush_all. Idle
+   // devices are known to have had nothing to read up to seen.
+   void release(bool flush_all, steady_clock::time_point seen = steady_clock::now());
+   bool pending() const { return !waiting_.empty(); }
+   OutputBuffer &out() { return out_; }
+
+   static constexpr milliseconds window = milliseconds(5);  // how late an idle device may deliver an event
+
+private:
+   void write(const Motion &m);
+
+   std::vector<std::unique_ptr<Device>> &devices_;  // lines are tagged with dev=N once there are several
+   OutputBuffer out_;
+   OutputBuffer *record_;
+   std::priority_queue<Motion, std::vector<Motion>, std::greater<Motion>> waiting_;
+   unsigned long sequence_ = 0;
+   int64_t t0_ns_ = INT64_MIN;
+};
+
+void
+Capture::add(int d, const struct input_event *events, ssize_t count)
+{
+   Device &device = *devices_[d];
+   if (record_)
+   {
+      char *records = record_->reserve(count * sizeof(CaptureRecord));
+      for (ssize_t i = 0; i < count; ++i)
+      {
+         const struct input_event &event = events[i];
+         CaptureRecord r = {eventNs(event), event.value, event.code, uint8_t(event.type), uint8_t(d)};
+         memcpy(records + i * sizeof(r), &r, sizeof(r));
+      }
+      record_->commit(count * sizeof(CaptureRecord));
+   }
+   for (ssize_t i = 0; i < count; ++i)
    {
+      const struct input_event &event = events[i];
+      device.events++;
+      device.last_ns = eventNs(event);
+      if (event.type == EV_SYN && event.code == SYN_DROPPED)
+      {
+         // The events up to the next SYN_REPORT are incomplete, see the evdev documentation
+         device.dropped++;
+         device.dropping = true;
+         device.frame_dx = device.frame_dy = 0L;
+         continue;
+      }
+      if (device.dropping)
+      {
+         device.dropping = !(event.type == EV_SYN && event.code == SYN_REPORT);
+         device.discarded++;
+         continue;
+      }
       if (event.type == EV_REL)
       {
-         dx = 0;
-         dy = 0;
-         if (event.code == 0)
+         if (event.code == REL_X)
          {
-            dx = event.value;
-            x += dx;
+            device.frame_dx += event.value;
          }
-         else if (event.code == 1)
+         else if (event.code == REL_Y)
          {
-            dy = event.value;
-            y += dy;
+            device.frame_dy += event.value;
          }
-
-         auto event_t = duration<float, std::ratio<1, 1>>(system_clock::time_point{seconds{event.time.tv_sec} + microseconds{event.time.tv_usec}} - t0).count();
-         std::cout << event_t
-                 << "\tx=" << x
-                 << "\ty=" << y
-                 << "\tdx=" << dx
-                 << "\tdy=" << dy
-                 << std::endl;
+         if (!record_)
+         {
+            waiting_.push({device.last_ns, sequence_++, d, event.code, event.value});
+         }
+      }
+      else if (event.type == EV_SYN && event.code == SYN_REPORT)
+      {
+         device.analysis.report(device.last_ns, device.frame_dx, device.frame_dy);
+         device.frame_dx = device.frame_dy = 0L;
       }
    }
+}
 
-   return 0;
+void
+Capture::release(bool flush_all, steady_clock::time_point seen)
+{
+   while (!waiting_.empty())
+   {
+      const Motion &m = waiting_.top();
+      bool overtakable = false;
+      for (size_t d = 0; d < devices_.size() && !flush_all; ++d)
+      {
+         const Device &other = *devices_[d];
+         if (other.open && int(d) != m.device && other.last_ns < m.time_ns && (!other.idle || seen - other.idle_since < window))
+         {
+            overtakable = true;
+            break;
+         }
+      }
+      if (overtakable)
+      {
+         break;
+      }
+      write(m);
+      waiting_.pop();
+   }
 }
 
+// Report one relative motion as a line of text
+void
+Capture::write(const Motion &m)
+{
+   Device &device = *devices_[m.device];
+   long dx = 0L, dy = 0L;
+   if (m.code == REL_X)
+   {
+      dx = m.value;
+      device.x += dx;
+   }
+   else if (m.code == REL_Y)
+   {
+      dy = m.value;
+      device.y += dy;
+   }
+
+   // Seconds since the first motion to the us, then the integers, without printf
+   if (t0_ns_ == INT64_MIN)
+   {
+      t0_ns_ = m.time_ns;
+   }
+   const size_t line_max = 160;
+   char *line = out_.reserve(line_max);
+   char *p = line;
+   int64_t t_us = (m.time_ns - t0_ns_) / 1000;
+   if (t_us < 0)
+   {
+      *p++ = '-';
+      t_us = -t_us;
+   }
+   p = appendDecimal(p, t_us / 1000000);
+   *p++ = '.';
+   for (int64_t digits = t_us % 1000000, scale = 100000; scale > 0; scale /= 10)
+   {
+      *p++ = char('0' + digits / scale % 10);
+   }
+   p = appendText(p, "\tx=");
+   p = appendDecimal(p, device.x);
+   p = appendText(p, "\ty=");
+   p = appendDecimal(p, device.y);
+   p = appendText(p, "\tdx=");
+   p = appendDecimal(p, dx);
+   p = appendText(p, "\tdy=");
+   p = appendDecimal(p, dy);
+   if (devices_.size() > 1)
+   {
+      p = appendText(p, "\tdev=");
+      p = appendDecimal(p, device.number);
+   }
+   *p++ = '\n';
+   out_.commit(p - line);
+}
+
+// What the thread reading the devices hands to the thread writing the output: an event
+// of device d, or news that device d has nothing waiting, has gone, is back, or is new
+struct RingEntry
+{
+   enum Note : int32_t { none, idle, closed, opened, added };  // none for an event
+
+   struct input_event event;
+   int32_t device;
+   Note note;
+};
+
+// Entries passed from one producer thread to one consumer thread without locks. Each
+// side writes only its own index, on a cache line of its own, and keeps a copy of the
+// other's index that it refreshes only when the ring looks full or empty.
+template <class T>
+class SpscRing
+{
+public:
+   explicit SpscRing(size_t capacity);  // rounded up to a power of 2
+
+   // Producer: copy in up to n entries leaving keep_free slots unused, the number copied
+   size_t push(const T *entries, size_t n, size_t keep_free = 0);
+   // Consumer: copy out up to n entries, the number copied
+   size_t pop(T *entries, size_t n);
+   bool empty() const { return tail_.load(std::memory_order_relaxed) == head_.load(std::memory_order_acquire); }
+
+   size_t capacity() const { return mask_ + 1; }
+   // Producer: the most entries ever waiting at once
+   size_t highWater() const { return high_water_; }
+
+private:
+   std::vector<T> slots_;
+   size_t mask_;
+
+   alignas(64) std::atomic<size_t> head_{0};  // next slot to write
+   size_t tail_seen_ = 0;
+   size_t high_water_ = 0;
+
+   alignas(64) std::atomic<size_t> tail_{0};  // next slot to read
+   size_t head_seen_ = 0;
+};
+
+template <class T>
+SpscRing<T>::SpscRing(size_t capacity)
+{
+   size_t size = 1;
+   while (size < capacity)
+   {
+      size *= 2;
+   }
+   slots_.resize(size);
+   mask_ = size - 1;
+}
+
+template <class T>
+size_t
+SpscRing<T>::push(const T *entries, size_t n, size_t keep_free)
+{
+   size_t head = head_.load(std::memory_order_relaxed);
+   if (head - tail_seen_ + n + keep_free > capacity())
+   {
+      tail_seen_ = tail_.load(std::memory_order_acquire);
+   }
+   size_t room = capacity() - (head - tail_seen_);
+   if (room <= keep_free)
+   {
+      return 0;
+   }
+   n = std::min(n, room - keep_free);
+   for (size_t i = 0; i < n; ++i)
+   {
+      slots_[(head + i) & mask_] = entries[i];
+   }
+   head_.store(head + n, std::memory_order_release);
+
+   if (head + n - tail_seen_ > high_water_)
+   {
+      // tail_seen_ may be old and the ring less full than it looks
+      tail_seen_ = tail_.load(std::memory_order_acquire);
+      high_water_ = std::max(high_water_, head + n - tail_seen_);
+   }
+   return n;
+}
+
+template <class T>
+size_t
+SpscRing<T>::pop(T *entries, size_t n)
+{
+   size_t tail = tail_.load(std::memory_order_relaxed);
+   if (head_seen_ - tail < n)
+   {
+      head_seen_ = head_.load(std::memory_order_acquire);
+   }
+   n = std::min(n, head_seen_ - tail);
+   for (size_t i = 0; i < n; ++i)
+   {
+      entries[i] = slots_[(tail + i) & mask_];
+   }
+   tail_.store(tail + n, std::memory_order_release);
+   return n;
+}
+
+// Where the reader thread runs; -1 and 0 leave the defaults
+struct ReaderOptions
+{
+   int cpu = -1;            // the only CPU it may run on
+   int fifo_priority = 0;   // SCHED_FIFO priority, 1 to 99
+};
+
+// What the reader thread and the consumer share
+struct Pipeline
+{
+   Pipeline() : ring(ring_capacity), added(max_capture_devices) {}
+
+   // Wake the consumer if it sleeps on an empty ring, after entries were pushed
+   void wake();
+
+   static const size_t ring_capacity = 1 << 16;
+
+   SpscRing<RingEntry> ring;
+   size_t reserve = 2 * max_capture_devices;  // slots only notes may take: an idle and a closed per device
+   std::vector<Device *> added;  // devices plugged in, set by the reader before its note
+   int wake_fd = -1;        // eventfd the consumer sleeps on
+   int stop_fd = -1;        // eventfd in the reader's epoll set, written to end the capture early
+   std::atomic<bool> consumer_asleep{false};
+   std::atomic<bool> stop{false};
+   std::atomic<bool> reader_done{false};
+   std::atomic<bool> reader_waiting{false};  // holds events it has read for want of room
+   std::atomic<int64_t> reader_seen{0};      // steady ns up to which every device was read, -1 while it waits for them
+   unsigned long overruns = 0;  // events lost because the ring was full, written by the reader
+};
+
+void
+Pipeline::wake()
+{
+   // Pairs with the fence in consume(): either the consumer sees the entries, or this sees it asleep
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   if (consumer_asleep.load(std::memory_order_relaxed))
+   {
+      uint64_t one = 1;
+      if (::write(wake_fd, &one, sizeof(one)) < 0)
+      {
+         // the counter is already non-zero, the consumer wakes anyway
+      }
+   }
+}
+
+// Hand a batch of device d to the consumer. A device cannot be kept waiting, so what does
+// not fit is lost and the consumer gets a SYN_DROPPED before the next events that do, as
+// from the kernel. Files and FIFOs wait for room instead.
+static
+void
+pushEvents(Pipeline &pipe, int d, Device &device, const struct input_event *events, size_t count)
+{
+   RingEntry entries[EventReader::capacity + 1];
+   size_t n = 0;
+   bool marked = device.overrun;
+   if (marked)
+   {
+      entries[n].event = events[0];
+      entries[n].event.type = EV_SYN;
+      entries[n].event.code = SYN_DROPPED;
+      entries[n].event.value = 0;
+      entries[n].device = d;
+      entries[n++].note = RingEntry::none;
+   }
+   for (size_t i = 0; i < count; ++i)
+   {
+      entries[n].event = events[i];
+      entries[n].device = d;
+      entries[n++].note = RingEntry::none;
+   }
+
+   size_t done = pipe.ring.push(entries, n, pipe.reserve);
+   if (done < n && !device.live)
+   {
+      pipe.reader_waiting.store(true, std::memory_order_relaxed);
+      while (done < n && !pipe.stop.load(std::memory_order_relaxed))
+      {
+         pipe.wake();
+         std::this_thread::sleep_for(microseconds(100));
+         done += pipe.ring.push(entries + done, n - done, pipe.reserve);
+      }
+      pipe.reader_waiting.store(false, std::memory_order_release);
+   }
+   if (done > 0)
+   {
+      device.told_idle = false;
+      pipe.wake();
+   }
+   size_t lost = n - done - (marked && done == 0 ? 1 : 0);
+   device.overrun = done < n;
+   device.overruns += lost;
+   pipe.overruns += lost;
+}
+
+// Tell the consumer about device d, taking the slots kept for notes if need be
+static
+void
+pushNote(Pipeline &pipe, int d, RingEntry::Note note)
+{
+   RingEntry entry = {};
+   entry.device = d;
+   entry.note = note;
+   while (pipe.ring.push(&entry, 1) == 0 && !pipe.stop.load(std::memory_order_relaxed))
+   {
+      pipe.wake();
+      std::this_thread::sleep_for(microseconds(100));  // only if a device came and went many times
+   }
+   pipe.wake();
+}
+
+// Read what device d has until it would block; false when the device is gone
+static
+bool
+service(Pipeline &pipe, int d, Device &device)
+{
+   while (true)
+   {
+      ssize_t count = device.reader.read();
+      if (count > 0 && device.live)
+      {
+         struct timespec now;
+         clock_gettime(device.clock, &now);
+         int64_t now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+         const struct input_event *events = device.reader.events();
+         for (ssize_t i = 0; i < count; ++i)
+         {
+            device.latency.record(now_ns - eventNs(events[i]));
+         }
+      }
+      if (count > 0)
+      {
+         pushEvents(pipe, d, device, device.reader.events(), count);
+         if (!device.pollable)
+         {
+            return true;  // a regular file, read a batch per turn so the others keep up
+         }
+         continue;
+      }
+      if (count < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if (count < 0 && errno == EAGAIN)
+      {
+         if (!device.told_idle)
+         {
+            pushNote(pipe, d, RingEntry::idle);
+            device.told_idle = true;
+         }
+         return true;
+      }
+      if (count < 0)
+      {
+         std::cerr << "Cannot read \"" << device.name << "\": " << strerror(errno) << std::endl;
+      }
+      pushNote(pipe, d, RingEntry::closed);
+      return false;  // end of the file, the writer of the FIFO has gone, or the device was unplugged
+   }
+}
+
+// Learn whether the input just opened at path is a device, and ask a device for monotonic
+// event times, which do not jump with the wall clock and spoil intervals
+static
+void
+setupDevice(Device &device, const std::string &path)
+{
+   struct stat st;
+   device.live = fstat(device.fd, &st) == 0 && S_ISCHR(st.st_mode);
+   int monotonic = CLOCK_MONOTONIC;
+   if (!device.live)
+   {
+      device.clock = CLOCK_MONOTONIC;  // whatever it was recorded with, it is not ours to set
+   }
+   else if (ioctl(device.fd, EVIOCSCLOCKID, &monotonic) == 0)
+   {
+      device.clock = CLOCK_MONOTONIC;
+   }
+   else
+   {
+      std::cerr << "\"" << path << "\" keeps CLOCK_REALTIME event times: " << strerror(errno) << std::endl;
+   }
+}
+
+// Where devices are found, and whether to look for more while capturing
+struct HotplugOptions
+{
+   std::string proc_devices = "/proc/bus/input/devices";
+   std::string input_dir = "/dev/input";
+   bool watch = false;      // reopen mice that come back after being unplugged
+   bool add_mice = false;   // and read new ones too
+};
+
+// Device nodes appearing in a directory, as in /dev/input when a mouse is plugged in
+class HotplugWatcher
+{
+public:
+   explicit HotplugWatcher(const std::string &dir);
+   ~HotplugWatcher();
+
+   int fd() const { return fd_; }
+   // The N of every eventN created or changed since the last call
+   std::vector<int> changed();
+
+private:
+   int fd_;
+};
+
+HotplugWatcher::HotplugWatcher(const std::string &dir) : fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+{
+   // udev makes the node, then gives it its group and mode, and only then may we open it
+   if (fd_ >= 0 && inotify_add_watch(fd_, dir.c_str(), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0)
+   {
+      close(fd_);
+      fd_ = -1;
+   }
+}
+
+HotplugWatcher::~HotplugWatcher()
+{
+   if (fd_ >= 0)
+   {
+      close(fd_);
+   }
+}
+
+std::vector<int>
+HotplugWatcher::changed()
+{
+   std::vector<int> nodes;
+   alignas(struct inotify_event) char buffer[4096];
+   ssize_t n;
+   while ((n = read(fd_, buffer, sizeof(buffer))) > 0)
+   {
+      for (const char *p = buffer; p < buffer + n; )
+      {
+         const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+         int node = event->len > 0 ? handlerNumber(event->name, "event") : -1;
+         if (node >= 0 && std::find(nodes.begin(), nodes.end(), node) == nodes.end())
+         {
+            nodes.push_back(node);
+         }
+         p += sizeof(struct inotify_event) + event->len;
+      }
+   }
+   return nodes;
+}
+
+// Node eventN has appeared or changed. A mouse we lost that is back, or with add_mice
+// a mouse we have not seen, is opened and the consumer told; its index, or -1.
+static
+int
+plugIn(std::vector<Device *> &devices, Pipeline &pipe, const HotplugOptions &options, int node)
+{
+   for (Device *device: devices)
+   {
+      if (device->reading && device->node == node)
+      {
+         return -1;
+      }
+   }
+   MouseDeviceMap mice = getMouseDevices(options.proc_devices);
+   auto mouse = mice.find(node);
+   if (mouse == mice.end())
+   {
+      return -1;  // not a mouse
+   }
+   const InputDevice &info = mouse->second;
+   int d = -1;
+   for (size_t i = 0; i < devices.size() && d < 0; ++i)
+   {
+      const Device &lost = *devices[i];
+      if (!lost.reading && lost.node >= 0 && lost.vendor == info.vendor && lost.product == info.product && lost.name == info.name)
+      {
+         d = i;
+      }
+   }
+   if (d < 0 && (!options.add_mice || devices.size() >= max_capture_devices))
+   {
+      return -1;
+   }
+
+   std::string path = options.input_dir + "/event" + std::to_string(node);
+   int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+   if (fd < 0)
+   {
+      return -1;  // not ours to read yet, udev has more to change
+   }
+   RingEntry::Note note = RingEntry::opened;
+   if (d >= 0)
+   {
+      Device &device = *devices[d];
+      close(device.fd);
+      device.fd = fd;
+      device.reader = EventReader(fd);
+      device.told_idle = false;
+      device.overrun = false;
+   }
+   else
+   {
+      d = devices.size();
+      devices.push_back(new Device(fd, node, info.name));
+      devices[d]->vendor = info.vendor;
+      devices[d]->product = info.product;
+      pipe.added[d] = devices[d];
+      note = RingEntry::added;
+   }
+   Device &device = *devices[d];
+   device.node = node;
+   device.reading = true;
+   setupDevice(device, path);
+   pushNote(pipe, d, note);
+   std::cerr << (note == RingEntry::added ? "Added" : "Reopened") << " \"" << device.name << "\" at " << path << std::endl;
+   return d;
+}
+
+// The reader thread: read every device as soon as it has something, until they all end
+// or the consumer asks to stop, and never do anything slow in between. Watching for
+// devices plugged in, it goes on until the consumer asks.
+static
+void
+readDevices(std::vector<Device *> devices, Pipeline &pipe, const HotplugOptions &options)
+{
+   const uint32_t stop_id = max_capture_devices, hotplug_id = max_capture_devices + 1;
+   int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (epoll_fd < 0)
+   {
+      std::cerr << "Cannot create an epoll instance: " << strerror(errno) << std::endl;
+      for (size_t d = 0; d < devices.size(); ++d)
+      {
+         pushNote(pipe, d, RingEntry::closed);
+      }
+      pipe.reader_done.store(true, std::memory_order_release);
+      pipe.wake();
+      return;
+   }
+   struct epoll_event stop_ev = {};
+   stop_ev.events = EPOLLIN;
+   stop_ev.data.u32 = stop_id;
+   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe.stop_fd, &stop_ev);
+
+   std::unique_ptr<HotplugWatcher> watcher;
+   if (options.watch)
+   {
+      watcher.reset(new HotplugWatcher(options.input_dir));
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.u32 = hotplug_id;
+      if (watcher->fd() < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watcher->fd(), &ev) < 0)
+      {
+         std::cerr << "Cannot watch \"" << options.input_dir << "\" for mice plugged in: " << strerror(errno) << std::endl;
+         watcher.reset();
+      }
+   }
+
+   int files = 0;  // regular files, read without waiting
+   auto watch = [&](size_t d)
+   {
+      struct epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.u32 = d;
+      devices[d]->pollable = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, devices[d]->fd, &ev) == 0;
+      files += devices[d]->pollable ? 0 : 1;
+   };
+   for (size_t d = 0; d < devices.size(); ++d)
+   {
+      watch(d);
+   }
+
+   size_t open = devices.size();
+   while ((open > 0 || watcher) && !pipe.stop.load(std::memory_order_relaxed))
+   {
+      // Asleep in epoll_wait() it misses nothing, otherwise it knows only up to the last wait
+      struct epoll_event ready[16];
+      if (files == 0)
+      {
+         pipe.reader_seen.store(-1, std::memory_order_release);
+      }
+      int n = epoll_wait(epoll_fd, ready, 16, files > 0 ? 0 : -1);
+      pipe.reader_seen.store(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count(), std::memory_order_release);
+      if (n < 0 && errno != EINTR)
+      {
+         std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+         break;
+      }
+      for (int i = 0; i < n; ++i)
+      {
+         size_t d = ready[i].data.u32;
+         if (d == hotplug_id)
+         {
+            for (int node: watcher->changed())
+            {
+               int plugged = plugIn(devices, pipe, options, node);
+               if (plugged >= 0)
+               {
+                  watch(plugged);
+                  open++;
+               }
+            }
+         }
+         else if (d < devices.size() && devices[d]->reading && !service(pipe, d, *devices[d]))
+         {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, devices[d]->fd, nullptr);
+            devices[d]->reading = false;
+            open--;
+         }
+      }
+      for (size_t d = 0; d < devices.size(); ++d)
+      {
+         if (!devices[d]->pollable && devices[d]->reading && !service(pipe, d, *devices[d]))
+         {
+            devices[d]->reading = false;
+            files--;
+            open--;
+         }
+      }
+   }
+   close(epoll_fd);
+   pipe.reader_done.store(true, std::memory_order_release);
+   pipe.wake();
+}
+
+// One line of percentiles in us
+static
+void
+printPercentiles(const char *label, const HdrHistogram &histogram)
+{
+   char line[200];
+   snprintf(line, sizeof line, "\t%-8s p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f us, %llu samples", label,
+            histogram.percentile(0.5) / 1e3, histogram.percentile(0.9) / 1e3, histogram.percentile(0.99) / 1e3,
+            histogram.percentile(0.999) / 1e3, histogram.max() / 1e3, (unsigned long long)histogram.count());
+   std::cerr << line << std::endl;
+}
+
+// The report intervals of each device with the outliers rejected, the polling rate they
+// make, then the tails of the intervals and of the delivery latency, on stderr
+static
+void
+printReportAnalysis(const std::vector<std::unique_ptr<Device>> &devices)
+{
+   for (auto &device: devices)
+   {
+      std::cerr << device->name << ": intervals after 3-sigma rejection" << std::endl;
+      const std::pair<const char *, const IntervalStats *> axes[] = {
+         {"reports", &device->analysis.any}, {"x", &device->analysis.x}, {"y", &device->analysis.y}};
+      for (auto &axis: axes)
+      {
+         RunningStats kept = axis.second->kept();
+         unsigned long all = axis.second->all().count();
+         char line[160];
+         if (kept.count() == 0 || kept.mean() <= 0)
+         {
+            snprintf(line, sizeof line, "\t%-8s %lu intervals", axis.first, all);
+         }
+         else
+         {
+            snprintf(line, sizeof line, "\t%-8s %10.2f us  sd %8.2f us  %9.1f Hz  %lu of %lu rejected",
+                     axis.first, kept.mean(), kept.stddev(), 1e6 / kept.mean(), all - kept.count(), all);
+         }
+         std::cerr << line << std::endl;
+      }
+      if (device->analysis.jitter.count() > 0)
+      {
+         printPercentiles("interval", device->analysis.jitter);
+      }
+      if (device->latency.count() > 0)
+      {
+         printPercentiles("latency", device->latency);
+      }
+   }
+}
+
+// The consumer: merge, write and record what the reader hands over, writing the output at
+// most every flush_interval so that a slow terminal is not written once per event, and the
+// report analysis every summary_interval if that is not 0
+static
+void
+consume(std::vector<std::unique_ptr<Device>> &devices, Pipeline &pipe, OutputBuffer *record,
+        milliseconds summary_interval)
+{
+   const auto flush_interval = milliseconds(100);
+   const size_t batch = 1024;
+   Capture capture(devices, record);
+   auto last_flush = steady_clock::now();
+   auto last_summary = last_flush;
+   RingEntry entries[batch];
+   struct input_event events[batch];
+
+   while (true)
+   {
+      bool done = pipe.reader_done.load(std::memory_order_acquire);
+      bool behind = pipe.reader_waiting.load(std::memory_order_acquire);
+      size_t n = pipe.ring.pop(entries, batch);
+      for (size_t i = 0; i < n; )
+      {
+         int d = entries[i].device;
+         if (entries[i].note == RingEntry::added)
+         {
+            devices.emplace_back(pipe.added[d]);
+         }
+         Device &device = *devices[d];
+         if (entries[i].note == RingEntry::opened || entries[i].note == RingEntry::added)
+         {
+            device.open = true;
+            device.idle = false;
+            device.dropping = false;
+            device.frame_dx = device.frame_dy = 0L;
+            // The time it was unplugged is no report interval
+            device.analysis.last_any = device.analysis.last_x = device.analysis.last_y = -1;
+            ++i;
+            continue;
+         }
+         if (entries[i].note == RingEntry::idle)
+         {
+            if (!device.idle)
+            {
+               device.idle = true;
+               device.idle_since = steady_clock::now();
+            }
+            ++i;
+            continue;
+         }
+         if (entries[i].note == RingEntry::closed)
+         {
+            device.open = false;
+            ++i;
+            continue;
+         }
+         size_t run = 0;
+         while (i < n && entries[i].device == d && entries[i].note == RingEntry::none)
+         {
+            events[run++] = entries[i++].event;
+         }
+         device.idle = false;
+         capture.add(d, events, run);
+      }
+
+      if (n == 0 && done)
+      {
+         break;
+      }
+      if (stop_capture && !pipe.stop.load(std::memory_order_relaxed))
+      {
+         pipe.stop.store(true, std::memory_order_relaxed);
+         uint64_t one = 1;
+         if (::write(pipe.stop_fd, &one, sizeof(one)) < 0)
+         {
+            std::cerr << "Cannot stop the reader: " << strerror(errno) << std::endl;
+         }
+      }
+      if (n == 0)
+      {
+         int timeout = -1;
+         if (capture.pending())
+         {
+            timeout = 1 + int(Capture::window.count());
+         }
+         else if (!capture.out().empty())
+         {
+            auto wait = duration_cast<milliseconds>(flush_interval - (steady_clock::now() - last_flush)).count();
+            timeout = std::max(0, int(wait));
+         }
+         if (summary_interval.count() > 0)
+         {
+            // A mouse at rest still gets its summaries on time
+            auto wait = duration_cast<milliseconds>(summary_interval - (steady_clock::now() - last_summary)).count();
+            int until = std::max(0, int(wait));
+            timeout = timeout < 0 ? until : std::min(timeout, until);
+         }
+         pipe.consumer_asleep.store(true, std::memory_order_relaxed);
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (pipe.ring.empty() && !pipe.reader_done.load(std::memory_order_acquire))
+         {
+            struct pollfd wake = {pipe.wake_fd, POLLIN, 0};
+            poll(&wake, 1, timeout);  // EINTR is a signal, checked on the next turn
+         }
+         pipe.consumer_asleep.store(false, std::memory_order_relaxed);
+         uint64_t wakes;
+         if (::read(pipe.wake_fd, &wakes, sizeof(wakes)) < 0)
+         {
+            // nobody woke it
+         }
+      }
+
+      // Devices said to be idle may have more behind a full batch, in the hands of the reader,
+      // or still unread if the reader has not run for a while
+      steady_clock::time_point seen;
+      if (n < batch && !behind)
+      {
+         int64_t reader_seen = pipe.reader_seen.load(std::memory_order_acquire);
+         seen = reader_seen < 0 ? steady_clock::now() : steady_clock::time_point(nanoseconds(reader_seen));
+      }
+      capture.release(false, seen);
+      if (!capture.out().empty() && steady_clock::now() - last_flush >= flush_interval)
+      {
+         capture.out().flush();
+         last_flush = steady_clock::now();
+      }
+      if (summary_interval.count() > 0 && steady_clock::now() - last_summary >= summary_interval)
+      {
+         printReportAnalysis(devices);
+         last_summary = steady_clock::now();
+      }
+   }
+   capture.release(true);
+}
+
+// Apply the options to the reader thread, complaining on stderr about what cannot be had
+static
+void
+configureReader(std::thread &reader, const ReaderOptions &options)
+{
+   if (options.cpu >= 0)
+   {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(options.cpu, &cpus);
+      int error = pthread_setaffinity_np(reader.native_handle(), sizeof(cpus), &cpus);
+      if (error != 0)
+      {
+         std::cerr << "Cannot pin the reader to CPU " << options.cpu << ": " << strerror(error) << std::endl;
+      }
+   }
+   if (options.fifo_priority > 0)
+   {
+      struct sched_param param = {};
+      param.sched_priority = options.fifo_priority;
+      int error = pthread_setschedparam(reader.native_handle(), SCHED_FIFO, &param);
+      if (error != 0)
+      {
+         std::cerr << "Cannot run the reader with SCHED_FIFO priority " << options.fifo_priority << ": " << strerror(error)
+                   << (error == EPERM ? " (CAP_SYS_NICE or an RLIMIT_RTPRIO is needed)" : "") << std::endl;
+      }
+   }
+}
+
+// Capture from every device until they all end or a signal arrives. A thread of its own
+// reads the devices into a ring, so that a slow terminal, disk or pipe on the output
+// delays nothing but the consumer, which runs on this thread.
+static
+int
+capture(std::vector<std::unique_ptr<Device>> &devices, OutputBuffer *record, const ReaderOptions &options,
+        const HotplugOptions &hotplug, milliseconds summary_interval)
+{
+   Pipeline pipe;
+   pipe.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   pipe.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (pipe.wake_fd < 0 || pipe.stop_fd < 0)
+   {
+      std::cerr << "Cannot create an eventfd: " << strerror(errno) << std::endl;
+      return 1;
+   }
+
+   // Signals go to this thread, which tells the reader to stop
+   sigset_t stop_signals, old_mask;
+   sigemptyset(&stop_signals);
+   sigaddset(&stop_signals, SIGINT);
+   sigaddset(&stop_signals, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+   std::vector<Device *> reading;
+   for (auto &device: devices)
+   {
+      reading.push_back(device.get());
+   }
+   std::thread reader(readDevices, reading, std::ref(pipe), std::cref(hotplug));
+   pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+   configureReader(reader, options);
+
+   consume(devices, pipe, record, summary_interval);
+   reader.join();
+   close(pipe.wake_fd);
+   close(pipe.stop_fd);
+   std::cerr << "Ring: " << pipe.ring.highWater() << " of " << pipe.ring.capacity() << " entries used at most, "
+             << pipe.overruns << " events lost to overruns" << std::endl;
+   return 0;
+}
+
+// What each device sent and lost, on stderr
+static
+void
+printDeviceCounts(const std::vector<std::unique_ptr<Device>> &devices)
+{
+   for (auto &device: devices)
+   {
+      std::cerr << device->name << ": "
+              << device->events << " events, "
+              << device->dropped << " SYN_DROPPED, "
+              << device->discarded << " events discarded after them";
+      if (device->overruns > 0)
+      {
+         std::cerr << ", " << device->overruns << " lost to ring overruns";
+      }
+      std::cerr << std::endl;
+   }
+}
+
+// Start a capture file with the header and the list of devices
+static
+void
+writeCaptureHeader(OutputBuffer &record, const std::vector<std::unique_ptr<Device>> &devices, clockid_t clock, int64_t start_ns)
+{
+   CaptureHeader header = {};
+   memcpy(header.magic, capture_magic, sizeof(header.magic));
+   header.version = capture_version;
+   header.clock = clock;
+   header.start_ns = start_ns;
+   header.devices = devices.size();
+   header.record_size = sizeof(CaptureRecord);
+   memcpy(record.reserve(sizeof(header)), &header, sizeof(header));
+   record.commit(sizeof(header));
+
+   for (auto &device: devices)
+   {
+      CaptureDevice entry = {};
+      entry.number = device->number;
+      strncpy(entry.name, device->name.c_str(), sizeof(entry.name) - 1);
+      memcpy(record.reserve(sizeof(entry)), &entry, sizeof(entry));
+      record.commit(sizeof(entry));
+   }
+}
+
+// Feed a capture file through the same processing as live devices, as fast as possible
+// or at the pace it was recorded. The file is mapped rather than read.
+static
+int
+replay(const std::string &filename, bool realtime, OutputBuffer *record)
+{
+   int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) < 0)
+   {
+      std::cerr << "Cannot open \"" << filename << "\": " << strerror(errno) << std::endl;
+      return 1;
+   }
+   size_t size = st.st_size;
+   if (size < sizeof(CaptureHeader))  // an empty file among them, which mmap() refuses
+   {
+      close(fd);
+      std::cerr << "\"" << filename << "\" is not a capture file of version " << capture_version << std::endl;
+      return 1;
+   }
+   void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (mapped == MAP_FAILED)
+   {
+      std::cerr << "Cannot map \"" << filename << "\": " << strerror(errno) << std::endl;
+      return 1;
+   }
+   madvise(mapped, size, MADV_SEQUENTIAL);
+   const char *data = static_cast<const char *>(mapped);
+
+   CaptureHeader header;
+   memcpy(&header, data, sizeof(header));
+   size_t records_start = sizeof(header) + size_t(header.devices) * sizeof(CaptureDevice);
+   if (memcmp(header.magic, capture_magic, sizeof(header.magic)) != 0
+       || header.version != capture_version || header.record_size != sizeof(CaptureRecord)
+       || header.devices == 0 || header.devices > max_capture_devices || size < records_start)
+   {
+      std::cerr << "\"" << filename << "\" is not a capture file of version " << capture_version << std::endl;
+      munmap(mapped, size);
+      return 1;
+   }
+
+   std::vector<std::unique_ptr<Device>> devices;
+   for (uint32_t d = 0; d < header.devices; ++d)
+   {
+      CaptureDevice entry;
+      memcpy(&entry, data + sizeof(header) + d * sizeof(entry), sizeof(entry));
+      entry.name[sizeof(entry.name) - 1] = '\0';
+      devices.emplace_back(new Device(-1, entry.number, entry.name));
+   }
+
+   // A device whose last record has been fed can hold nothing back any more
+   size_t count = (size - records_start) / sizeof(CaptureRecord);
+   std::vector<size_t> last(devices.size(), count);
+   CaptureRecord r;
+   for (size_t i = 0; i < count; ++i)
+   {
+      memcpy(&r, data + records_start + i * sizeof(r), sizeof(r));
+      if (r.device < devices.size())
+      {
+         last[r.device] = i;
+      }
+   }
+   for (size_t d = 0; d < devices.size(); ++d)
+   {
+      devices[d]->open = last[d] < count;
+   }
+
+   if (record)
+   {
+      writeCaptureHeader(*record, devices, header.clock, header.start_ns);
+   }
+   Capture capture(devices, record);
+   auto replay_start = steady_clock::now();
+   int64_t first_ns = INT64_MIN;
+   for (size_t i = 0; i < count && !stop_capture; ++i)
+   {
+      memcpy(&r, data + records_start + i * sizeof(r), sizeof(r));
+      if (r.device >= devices.size())
+      {
+         continue;
+      }
+      if (first_ns == INT64_MIN)
+      {
+         first_ns = r.time_ns;
+      }
+      if (realtime)
+      {
+         auto due = replay_start + nanoseconds(r.time_ns - first_ns);
+         if (due > steady_clock::now())
+         {
+            capture.release(false);
+            capture.out().flush();
+            std::this_thread::sleep_until(due);
+         }
+      }
+
+      struct input_event event = {};
+      event.time.tv_sec = r.time_ns / 1000000000;
+      event.time.tv_usec = r.time_ns % 1000000000 / 1000;
+      event.type = r.type;
+      event.code = r.code;
+      event.value = r.value;
+      capture.add(r.device, &event, 1);
+      if (i == last[r.device])
+      {
+         devices[r.device]->open = false;
+      }
+      if (i % 4096 == 4095)
+      {
+         capture.release(false);
+      }
+   }
+   capture.release(true);
+   munmap(mapped, size);
+   printDeviceCounts(devices);
+   printReportAnalysis(devices);
+   return 0;
+}
+
+// Tell why device_number is not a choice
+static
+void
+noSuchDevice(const std::string &device_number, const MouseDeviceMap &devices)
+{
+   printMouseDevices(
+           std::cout << "No such device \"" << device_number << "\".\n"
+           << "please choose one of:\n\n", devices)
+           << std::endl;
+}
+
+int
+main(int argc, char *argv[])
+{
+   std::vector<std::string> device_numbers;
+   std::vector<std::string> input_filenames;
+   std::string record_filename;
+   std::string replay_filename;
+   bool all_mice = false;
+   bool realtime = false;
+   ReaderOptions reader_options;
+   milliseconds summary_interval(0);
+   HotplugOptions hotplug;
+
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string arg = argv[i];
+      if ((arg == "--input" || arg == "-i") && i + 1 < argc)
+      {
+         input_filenames.push_back(argv[++i]);
+      }
+      else if (arg == "--all" || arg == "-a")
+      {
+         all_mice = true;
+      }
+      else if ((arg == "--record" || arg == "-w") && i + 1 < argc)
+      {
+         record_filename = argv[++i];
+      }
+      else if ((arg == "--replay" || arg == "-r") && i + 1 < argc)
+      {
+         replay_filename = argv[++i];
+      }
+      else if (arg == "--proc-devices" && i + 1 < argc)
+      {
+         hotplug.proc_devices = argv[++i];
+      }
+      else if (arg == "--input-dir" && i + 1 < argc)
+      {
+         hotplug.input_dir = argv[++i];
+      }
+      else if (arg == "--realtime")
+      {
+         realtime = true;
+      }
+      else if (arg == "--summary" && i + 1 < argc)
+      {
+         try
+         {
+            summary_interval = milliseconds(long(std::stod(argv[++i]) * 1000));
+         }
+         catch (const std::exception &e)
+         {
+            usage(*argv, getMouseDevices(hotplug.proc_devices));
+            return 1;
+         }
+      }
+      else if ((arg == "--cpu" || arg == "--fifo") && i + 1 < argc)
+      {
+         try
+         {
+            (arg == "--cpu" ? reader_options.cpu : reader_options.fifo_priority) = std::stoi(argv[++i]);
+         }
+         catch (const std::exception &e)
+         {
+            usage(*argv, getMouseDevices(hotplug.proc_devices));
+            return 1;
+         }
+      }
+      else if (arg[0] != '-')
+      {
+         device_numbers.push_back(arg);
+      }
+      else
+      {
+         usage(*argv, getMouseDevices(hotplug.proc_devices));
+         return 1;
+      }
+   }
+
+   auto devices = getMouseDevices(hotplug.proc_devices);
+   if (all_mice)
+   {
+      for (auto &device: devices)
+      {
+         device_numbers.push_back(std::to_string(device.first));
+      }
+   }
+   bool live = all_mice || !device_numbers.empty() || !input_filenames.empty();
+   if (live == !replay_filename.empty() || (realtime && replay_filename.empty()))
+   {
+      usage(*argv, devices);
+      return live || all_mice || realtime ? 1 : 0;
+   }
+
+   struct sigaction action = {};
+   action.sa_handler = onStopSignal;  // no SA_RESTART, so that a blocked poll() returns
+   sigaction(SIGINT, &action, nullptr);
+   sigaction(SIGTERM, &action, nullptr);
+
+   // Every event goes into a capture file instead of the text output
+   std::unique_ptr<OutputBuffer> record;
+   int record_fd = -1;
+   if (!record_filename.empty())
+   {
+      record_fd = open(record_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (record_fd < 0)
+      {
+         std::cerr << "Cannot create \"" << record_filename << "\": " << strerror(errno) << std::endl;
+         return 1;
+      }
+      record.reset(new OutputBuffer(record_fd, 4 << 20));
+   }
+
+   if (!replay_filename.empty())
+   {
+      int status = replay(replay_filename, realtime, record.get());
+      record.reset();
+      if (record_fd >= 0)
+      {
+         close(record_fd);
+      }
+      return status;
+   }
+
+   // choose mouse devices, then the files standing in for devices
+   std::vector<std::pair<std::string, std::string>> inputs;  // file name and device name
+   std::vector<int> numbers;
+   std::vector<const InputDevice *> found;  // what /proc says of the devices, nullptr for files
+   for (const std::string &device_number: device_numbers)
+   {
+      MouseDeviceMap::const_iterator device = devices.end();
+      try
+      {
+         device = devices.find(stoi(device_number));
+      }
+      catch (const std::invalid_argument &e)
+      {
+         noSuchDevice(device_number, devices);
+         return 1;
+      }
+      if (device == devices.end())
+      {
+         noSuchDevice(device_number, devices);
+         return 0;
+      }
+      std::cout << "\nUsing mouse device \"" << device->second.name << "\"" << std::endl;
+      inputs.emplace_back(hotplug.input_dir + "/event" + std::to_string(device->first), device->second.name);
+      numbers.push_back(device->first);
+      found.push_back(&device->second);
+   }
+   for (size_t i = 0; i < input_filenames.size(); ++i)
+   {
+      inputs.emplace_back(input_filenames[i], input_filenames[i]);
+      numbers.push_back(int(i));
+      found.push_back(nullptr);
+   }
+   // Mice unplugged are opened again when they come back, and with --all new ones are added,
+   // unless recording, as a capture file lists its devices at the start
+   hotplug.watch = all_mice || !device_numbers.empty();
+   hotplug.add_mice = all_mice && !record;
+   if (inputs.empty() && !hotplug.add_mice)
+   {
+      std::cerr << "There is no mouse to capture." << std::endl;
+      return 1;
+   }
+
+
+   // Read and report the events from the mouse input devices.
+   std::vector<std::unique_ptr<Device>> opened;
+   for (size_t i = 0; i < inputs.size(); ++i)
+   {
+      int fd = open(inputs[i].first.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      if (fd < 0)
+      {
+         std::cerr << "Cannot open \"" << inputs[i].first << "\": " << strerror(errno) << std::endl;
+         for (auto &device: opened)
+         {
+            close(device->fd);
+         }
+         return 1;
+      }
+      opened.emplace_back(new Device(fd, numbers[i], inputs[i].second));
+      Device &device = *opened.back();
+      if (found[i])
+      {
+         device.node = found[i]->event;
+         device.vendor = found[i]->vendor;
+         device.product = found[i]->product;
+      }
+      setupDevice(device, inputs[i].first);
+   }
+
+   // A capture file says which clock its times are on, the one of every device if they agree
+   clockid_t clock = CLOCK_MONOTONIC;
+   for (auto &device: opened)
+   {
+      if (device->clock != CLOCK_MONOTONIC)
+      {
+         clock = CLOCK_REALTIME;
+      }
+   }
+   if (record)
+   {
+      struct timespec start;
+      clock_gettime(clock, &start);
+      writeCaptureHeader(*record, opened, clock, start.tv_sec * 1000000000LL + start.tv_nsec);
+   }
+   int status = capture(opened, record.get(), reader_options, hotplug, summary_interval);
+   record.reset();
+   if (record_fd >= 0)
+   {
+      close(record_fd);
+   }
+
+   for (auto &device: opened)
+   {
+      close(device->fd);
+   }
+   printDeviceCounts(opened);
+   printReportAnalysis(opened);
+   return status;
+}